@@ -0,0 +1,684 @@
+//
+// chat_bench.cpp
+// ~~~~~~~~~~~~~~
+//
+// Load generator for chat_server. Publishers stand in for the Kinect host
+// and send data frames at a fixed rate; subscribers stand in for robots and
+// time every frame from publish to delivery. Both ends run in this process,
+// so they share one clock. With --control-rate, one more connection sends
+// stop and button commands, timed on their own, to show how long a command
+// waits behind the publishers' bulk traffic. --max-control-latency makes
+// that a check: chat_bench exits with status 2 if a command took longer,
+// or did not arrive. --connect-wait gives a relay started alongside the
+// bench time to start listening.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "asio.hpp"
+#include "chat_message.hpp"
+#include "kinect_command.hpp"
+#include "pooled_message.hpp"
+
+using asio::ip::tcp;
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct bench_config
+{
+  bench_config()
+    : publishers(1),
+      subscribers(1),
+      rate(1000),
+      control_rate(0),
+      max_control_latency(0),
+      size(64),
+      warmup(1),
+      duration(5),
+      connect_wait(0),
+      threads(1)
+  {
+  }
+
+  std::size_t publishers;
+  std::size_t subscribers;
+  std::size_t rate;     // messages per second, per publisher
+  std::size_t control_rate; // commands per second
+  std::size_t max_control_latency; // us a command may take, 0 for any
+  std::size_t size;     // body bytes
+  std::size_t warmup;   // seconds before measuring
+  std::size_t duration; // seconds measured
+  std::size_t connect_wait; // seconds to retry a refused first connect
+  std::size_t threads;
+  std::string output;   // where to write the JSON result, if anywhere
+};
+
+// Only frames published inside [begin, end) are counted, so the numbers
+// cover the steady state and not the ramp up or the drain. Commands carry
+// their publish time in the sequence field, in microseconds from epoch.
+struct bench_window
+{
+  std::int64_t epoch;
+  std::int64_t begin;
+  std::int64_t end;
+
+  bool contains(std::int64_t t) const
+  {
+    return t >= begin && t < end;
+  }
+};
+
+inline std::int64_t bench_now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      bench_clock::now().time_since_epoch()).count();
+}
+
+// A bench body is bench_prefix() followed by the publish time in
+// nanoseconds as 16 hex digits, padded to the configured size.
+inline const char* bench_prefix()
+{
+  return "[bench] ";
+}
+
+enum { bench_stamp_length = 8 + 16 };
+
+//----------------------------------------------------------------------
+
+// Opens a connection as a v2 peer that takes bodies of up to max_body and
+// only the given topics.
+inline void bench_handshake(tcp::socket& socket, std::size_t max_body,
+    std::uint32_t topics)
+{
+  chat_message hello(chat_message::binary_header);
+  hello.type(chat_message::hello_type);
+  hello.body_length(chat_header::encode_hello(hello.body(), max_body));
+  hello.encode_header();
+  chat_message subscribe(chat_message::binary_header);
+  subscribe.make_subscribe(topics);
+  std::vector<asio::const_buffer> buffers;
+  buffers.push_back(asio::buffer(hello.data(), hello.length()));
+  buffers.push_back(asio::buffer(subscribe.data(), subscribe.length()));
+  asio::write(socket, buffers);
+}
+
+// Sends rate frames a second, catching up in one gathered write on each
+// tick for whatever fell due since the last one. A publisher that cannot
+// keep up sends fewer, and the report shows it. A control publisher sends
+// control_rate stop and button commands a second instead, alternating so
+// that no two in a row are the same.
+class bench_publisher
+{
+public:
+  bench_publisher(asio::io_service& io_service,
+      tcp::resolver::iterator endpoint_iterator, const bench_config& config,
+      const bench_window& window, bool control)
+    : socket_(io_service),
+      timer_(io_service),
+      config_(config),
+      window_(window),
+      control_(control),
+      rate_(control ? config.control_rate : config.rate),
+      msg_(chat_message::binary_header),
+      writing_(false),
+      sent_(0),
+      counted_msgs_(0),
+      disconnected_(false)
+  {
+    asio::connect(socket_, endpoint_iterator);
+    socket_.set_option(tcp::no_delay(true));
+    bench_handshake(socket_, pooled_message::max_body_length(), 0);
+
+    msg_.body_length(config.size);
+    std::memset(msg_.body(), 'x', config.size);
+    std::memcpy(msg_.body(), bench_prefix(), std::strlen(bench_prefix()));
+
+    kinect_command::opcode ops[] = { kinect_command::stop,
+      kinect_command::button };
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+      commands_[i] = chat_message(chat_message::binary_header);
+      kinect_command(ops[i]).encode(commands_[i]);
+    }
+  }
+
+  void start()
+  {
+    start_ = bench_clock::now();
+    do_read();
+    do_tick();
+  }
+
+  bool control() const
+  {
+    return control_;
+  }
+
+  std::size_t counted_msgs() const
+  {
+    return counted_msgs_;
+  }
+
+  bool disconnected() const
+  {
+    return disconnected_;
+  }
+
+private:
+  enum { tick_us = 1000 };
+  enum { max_batch = 1024 };
+
+  void do_tick()
+  {
+    timer_.expires_from_now(std::chrono::microseconds(tick_us));
+    timer_.async_wait(
+        [this](std::error_code ec)
+        {
+          if (ec)
+            return;
+          if (!writing_)
+            do_write();
+          do_tick();
+        });
+  }
+
+  void do_write()
+  {
+    std::uint64_t elapsed_us = std::chrono::duration_cast<
+      std::chrono::microseconds>(bench_clock::now() - start_).count();
+    std::uint64_t due = elapsed_us * rate_ / 1000000;
+    if (due <= sent_)
+      return;
+    std::size_t n = static_cast<std::size_t>(
+        std::min<std::uint64_t>(due - sent_, max_batch));
+
+    std::int64_t now = bench_now();
+    batch_.clear();
+    if (control_)
+    {
+      std::uint32_t stamp = static_cast<std::uint32_t>(
+          (now - window_.epoch) / 1000);
+      // Counted by the time in the stamp, as subscribers count them.
+      now = window_.epoch + static_cast<std::int64_t>(stamp) * 1000;
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        chat_message& cmd = commands_[sent_++ % 2];
+        cmd.sequence(stamp);
+        cmd.encode_header();
+        batch_.insert(batch_.end(), cmd.data(), cmd.data() + cmd.length());
+      }
+    }
+    else
+    {
+      char stamp[17];
+      std::snprintf(stamp, sizeof(stamp), "%016" PRIx64,
+          static_cast<std::uint64_t>(now));
+      std::memcpy(msg_.body() + std::strlen(bench_prefix()), stamp, 16);
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        msg_.sequence(static_cast<std::uint32_t>(++sent_));
+        msg_.encode_header();
+        batch_.insert(batch_.end(), msg_.data(), msg_.data() + msg_.length());
+      }
+    }
+    if (window_.contains(now))
+      counted_msgs_ += n;
+
+    writing_ = true;
+    asio::async_write(socket_, asio::buffer(batch_),
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          writing_ = false;
+          if (ec)
+          {
+            disconnected_ = true;
+            timer_.cancel();
+          }
+        });
+  }
+
+  // The relay's hello and anything else it sends is thrown away.
+  void do_read()
+  {
+    socket_.async_read_some(asio::buffer(discard_),
+        [this](std::error_code ec, std::size_t /*length*/)
+        {
+          if (!ec)
+            do_read();
+        });
+  }
+
+  tcp::socket socket_;
+  asio::steady_timer timer_;
+  const bench_config& config_;
+  const bench_window& window_;
+  bool control_;
+  std::size_t rate_;
+  pooled_message msg_;
+  chat_message commands_[2];
+  std::vector<char> batch_;
+  bool writing_;
+  bench_clock::time_point start_;
+  std::uint64_t sent_;
+  std::size_t counted_msgs_;
+  bool disconnected_;
+  char discard_[4096];
+};
+
+// Reads frames like a robot would and keeps the latency of each bench
+// frame and each command published inside the window.
+class bench_subscriber
+{
+public:
+  bench_subscriber(asio::io_service& io_service,
+      tcp::resolver::iterator endpoint_iterator, const bench_config& config,
+      const bench_window& window)
+    : socket_(io_service),
+      window_(window),
+      read_buffer_(2 * (chat_header::max_header_length
+            + pooled_message::max_body_length())),
+      heartbeat_(chat_message::binary_header),
+      received_msgs_(0),
+      received_bytes_(0),
+      disconnected_(false)
+  {
+    asio::connect(socket_, endpoint_iterator);
+    socket_.set_option(tcp::no_delay(true));
+    bench_handshake(socket_, pooled_message::max_body_length(),
+        chat_header::data_topic | chat_header::command_topic);
+    latencies_.reserve(std::min<std::size_t>(max_reserved_samples,
+          config.publishers * config.rate * config.duration));
+    heartbeat_.make_heartbeat();
+  }
+
+  void start()
+  {
+    do_read();
+  }
+
+  const std::vector<std::int64_t>& latencies() const
+  {
+    return latencies_;
+  }
+
+  const std::vector<std::int64_t>& control_latencies() const
+  {
+    return control_latencies_;
+  }
+
+  std::size_t received_msgs() const
+  {
+    return received_msgs_;
+  }
+
+  std::size_t received_bytes() const
+  {
+    return received_bytes_;
+  }
+
+  bool disconnected() const
+  {
+    return disconnected_;
+  }
+
+private:
+  enum { max_reserved_samples = 1 << 22 };
+
+  void do_read()
+  {
+    char* p = read_buffer_.prepare();
+    socket_.async_read_some(asio::buffer(p, read_buffer_.space()),
+        [this](std::error_code ec, std::size_t length)
+        {
+          if (!ec)
+            read_done(length);
+          else
+            disconnected_ = true;
+        });
+  }
+
+  void read_done(std::size_t length)
+  {
+    std::int64_t now = bench_now();
+    read_buffer_.commit(length);
+    chat_header header;
+    chat_read_buffer::parse_result result;
+    while ((result = read_buffer_.parse_header(header,
+            pooled_message::max_body_length()))
+        == chat_read_buffer::frame_ready)
+    {
+      std::size_t frame = header.header_size() + header.body_length();
+      if (read_buffer_.size() < frame)
+        break;
+      if (header.is_heartbeat())
+        send_heartbeat();
+      else if (header.type() == chat_header::command_type)
+        handle_command(header, now);
+      else
+        handle_frame(read_buffer_.data() + header.header_size(),
+            header.body_length(), frame, now);
+      read_buffer_.consume(frame);
+    }
+    if (result != chat_read_buffer::bad_frame)
+      do_read();
+    else
+      disconnected_ = true;
+  }
+
+  void handle_frame(const char* body, std::size_t length, std::size_t frame,
+      std::int64_t now)
+  {
+    std::size_t prefix = std::strlen(bench_prefix());
+    if (length < bench_stamp_length
+        || std::memcmp(body, bench_prefix(), prefix) != 0)
+      return;
+    char stamp[17];
+    std::memcpy(stamp, body + prefix, 16);
+    stamp[16] = 0;
+    std::int64_t sent = static_cast<std::int64_t>(
+        std::strtoull(stamp, 0, 16));
+    if (!window_.contains(sent))
+      return;
+    latencies_.push_back(now - sent);
+    ++received_msgs_;
+    received_bytes_ += frame;
+  }
+
+  // Subscribers only read, so the relay checks on them now and then.
+  void send_heartbeat()
+  {
+    asio::async_write(socket_,
+        asio::buffer(heartbeat_.data(), heartbeat_.length()),
+        [](std::error_code, std::size_t) {});
+  }
+
+  void handle_command(const chat_header& header, std::int64_t now)
+  {
+    std::int64_t sent = window_.epoch
+      + static_cast<std::int64_t>(header.sequence()) * 1000;
+    if (window_.contains(sent))
+      control_latencies_.push_back(now - sent);
+  }
+
+  tcp::socket socket_;
+  const bench_window& window_;
+  chat_read_buffer read_buffer_;
+  chat_message heartbeat_;
+  std::vector<std::int64_t> latencies_;
+  std::vector<std::int64_t> control_latencies_;
+  std::size_t received_msgs_;
+  std::size_t received_bytes_;
+  bool disconnected_;
+};
+
+//----------------------------------------------------------------------
+
+// The value below which fraction p of the sorted samples fall.
+inline double bench_percentile(const std::vector<std::int64_t>& sorted,
+    double p)
+{
+  if (sorted.empty())
+    return 0;
+  std::size_t i = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+  return static_cast<double>(sorted[i]);
+}
+
+// Returns once a connection to the relay succeeds, or false when the relay
+// has not accepted one within wait seconds.
+bool bench_wait_for_relay(asio::io_service& io_service,
+    tcp::resolver::iterator endpoint_iterator, std::size_t wait)
+{
+  bench_clock::time_point deadline =
+    bench_clock::now() + std::chrono::seconds(wait);
+  for (;;)
+  {
+    tcp::socket probe(io_service);
+    asio::error_code ec;
+    asio::connect(probe, endpoint_iterator, ec);
+    if (!ec)
+      return true;
+    if (bench_clock::now() >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    bench_config config;
+    int first_arg = 1;
+    while (first_arg + 1 < argc && argv[first_arg][0] == '-')
+    {
+      const char* option = argv[first_arg];
+      const char* value = argv[first_arg + 1];
+      if (std::strcmp(option, "--publishers") == 0)
+        config.publishers = std::atoi(value);
+      else if (std::strcmp(option, "--subscribers") == 0)
+        config.subscribers = std::atoi(value);
+      else if (std::strcmp(option, "--rate") == 0)
+        config.rate = std::atoi(value);
+      else if (std::strcmp(option, "--control-rate") == 0)
+        config.control_rate = std::atoi(value);
+      else if (std::strcmp(option, "--max-control-latency") == 0)
+        config.max_control_latency = std::atoi(value);
+      else if (std::strcmp(option, "--size") == 0)
+        config.size = std::atoi(value);
+      else if (std::strcmp(option, "--warmup") == 0)
+        config.warmup = std::atoi(value);
+      else if (std::strcmp(option, "--duration") == 0)
+        config.duration = std::atoi(value);
+      else if (std::strcmp(option, "--connect-wait") == 0)
+        config.connect_wait = std::atoi(value);
+      else if (std::strcmp(option, "--threads") == 0)
+        config.threads = std::atoi(value);
+      else if (std::strcmp(option, "--output") == 0)
+        config.output = value;
+      else
+        break;
+      first_arg += 2;
+    }
+
+    if (argc - first_arg != 2 || config.duration == 0
+        || (config.max_control_latency != 0 && config.control_rate == 0))
+    {
+      std::cerr << "Usage: chat_bench [--publishers <n>] [--subscribers <n>]"
+        " [--rate <msgs/s per publisher>] [--control-rate <cmds/s>]"
+        " [--max-control-latency <us>] [--size <body bytes>]"
+        " [--warmup <seconds>] [--duration <seconds>]"
+        " [--connect-wait <seconds>] [--threads <n>]"
+        " [--output <file>] <host> <port>\n";
+      return 1;
+    }
+    if (config.size < bench_stamp_length)
+      config.size = bench_stamp_length;
+    if (config.threads == 0)
+      config.threads = 1;
+    // Bodies above 512 bytes also need the relay started with --max-body.
+    pooled_message::max_body_length(std::max<std::size_t>(config.size,
+          chat_header::legacy_max_body_length));
+    char** args = argv + first_arg;
+
+    // Each connection lives on one io_service, each io_service on one
+    // thread, so nothing here is shared between threads while it runs.
+    std::vector<std::unique_ptr<asio::io_service>> services;
+    for (std::size_t i = 0; i < config.threads; ++i)
+      services.emplace_back(new asio::io_service);
+
+    tcp::resolver resolver(*services[0]);
+    auto endpoint_iterator = resolver.resolve({ args[0], args[1] });
+    if (config.connect_wait != 0 && !bench_wait_for_relay(*services[0],
+          endpoint_iterator, config.connect_wait))
+    {
+      std::cerr << "no relay listening on " << args[0] << ":" << args[1]
+        << " after " << config.connect_wait << " seconds\n";
+      return 1;
+    }
+
+    bench_window window;
+    std::list<bench_subscriber> subscribers;
+    for (std::size_t i = 0; i < config.subscribers; ++i)
+      subscribers.emplace_back(*services[i % config.threads],
+          endpoint_iterator, config, window);
+    std::list<bench_publisher> publishers;
+    for (std::size_t i = 0; i < config.publishers; ++i)
+      publishers.emplace_back(*services[i % config.threads],
+          endpoint_iterator, config, window, false);
+    if (config.control_rate != 0)
+      publishers.emplace_back(*services[config.publishers % config.threads],
+          endpoint_iterator, config, window, true);
+
+    std::int64_t now = bench_now();
+    window.epoch = now;
+    window.begin = now + static_cast<std::int64_t>(config.warmup) * 1000000000;
+    window.end = window.begin
+      + static_cast<std::int64_t>(config.duration) * 1000000000;
+
+    for (auto& s: subscribers)
+      s.start();
+    for (auto& p: publishers)
+      p.start();
+
+    std::vector<std::thread> threads;
+    for (auto& service: services)
+    {
+      asio::io_service* s = service.get();
+      threads.emplace_back([s](){ s->run(); });
+    }
+
+    // Leave a second after the window for the last frames to arrive.
+    std::this_thread::sleep_for(std::chrono::seconds(
+          config.warmup + config.duration + 1));
+    for (auto& service: services)
+      service->stop();
+    for (auto& t: threads)
+      t.join();
+
+    // Bodies the relay does not take, for one, get publishers disconnected.
+    std::size_t disconnects = 0;
+    std::size_t published = 0;
+    std::size_t control_published = 0;
+    for (auto& p: publishers)
+    {
+      (p.control() ? control_published : published) += p.counted_msgs();
+      disconnects += p.disconnected();
+    }
+    std::size_t delivered = 0;
+    std::size_t delivered_bytes = 0;
+    std::vector<std::int64_t> latencies;
+    std::vector<std::int64_t> control_latencies;
+    for (auto& s: subscribers)
+    {
+      delivered += s.received_msgs();
+      delivered_bytes += s.received_bytes();
+      disconnects += s.disconnected();
+      latencies.insert(latencies.end(), s.latencies().begin(),
+          s.latencies().end());
+      control_latencies.insert(control_latencies.end(),
+          s.control_latencies().begin(), s.control_latencies().end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(control_latencies.begin(), control_latencies.end());
+
+    double seconds = static_cast<double>(config.duration);
+    std::size_t expected = published * config.subscribers;
+    double p50 = bench_percentile(latencies, 0.50) / 1000;
+    double p99 = bench_percentile(latencies, 0.99) / 1000;
+    double p999 = bench_percentile(latencies, 0.999) / 1000;
+    double max = latencies.empty() ? 0 : latencies.back() / 1000.0;
+    std::size_t control_delivered = control_latencies.size();
+    double control_p50 = bench_percentile(control_latencies, 0.50) / 1000;
+    double control_p99 = bench_percentile(control_latencies, 0.99) / 1000;
+    double control_p999 = bench_percentile(control_latencies, 0.999) / 1000;
+    double control_max = control_latencies.empty()
+      ? 0 : control_latencies.back() / 1000.0;
+
+    char result[2048];
+    std::snprintf(result, sizeof(result),
+        "{\"publishers\": %zu, \"subscribers\": %zu, \"rate\": %zu,"
+        " \"size\": %zu, \"duration_s\": %zu, \"published_msgs\": %zu,"
+        " \"delivered_msgs\": %zu, \"lost_msgs\": %zu, \"disconnects\": %zu,"
+        " \"msgs_per_s\": %.1f, \"bytes_per_s\": %.1f,"
+        " \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f,"
+        " \"max\": %.1f}, \"control_rate\": %zu,"
+        " \"control_published\": %zu, \"control_delivered\": %zu,"
+        " \"control_latency_us\": {\"p50\": %.1f, \"p99\": %.1f,"
+        " \"p999\": %.1f, \"max\": %.1f}}",
+        config.publishers, config.subscribers, config.rate, config.size,
+        config.duration, published, delivered,
+        expected > delivered ? expected - delivered : 0, disconnects,
+        delivered / seconds, delivered_bytes / seconds,
+        p50, p99, p999, max, config.control_rate, control_published,
+        control_delivered, control_p50, control_p99, control_p999,
+        control_max);
+
+    std::cout << "published " << published / seconds << " msgs/s, delivered "
+      << delivered / seconds << " msgs/s, " << delivered_bytes / seconds
+      << " bytes/s, lost " << (expected > delivered ? expected - delivered : 0)
+      << "\nlatency us p50 " << p50 << " p99 " << p99 << " p999 " << p999
+      << " max " << max << "\n";
+    if (config.control_rate != 0)
+      std::cout << "commands published " << control_published
+        << ", delivered " << control_delivered << "\ncommand latency us p50 "
+        << control_p50 << " p99 " << control_p99 << " p999 " << control_p999
+        << " max " << control_max << "\n";
+    if (disconnects != 0)
+      std::cout << disconnects << " connections closed by the relay\n";
+    if (!config.output.empty())
+    {
+      std::ofstream out(config.output.c_str());
+      out << result << "\n";
+    }
+    else
+    {
+      std::cout << result << "\n";
+    }
+
+    // Every subscriber should have had every command, each in time. Bulk
+    // frames are allowed to go missing; that is what a saturated bulk lane
+    // does.
+    if (config.max_control_latency != 0)
+    {
+      std::size_t control_expected = control_published * config.subscribers;
+      if (control_expected == 0 || control_delivered < control_expected)
+      {
+        std::cout << "FAIL: " << control_delivered << " of "
+          << control_expected << " commands delivered\n";
+        return 2;
+      }
+      if (control_max > config.max_control_latency)
+      {
+        std::cout << "FAIL: command latency max " << control_max
+          << " us over the bound of " << config.max_control_latency
+          << " us\n";
+        return 2;
+      }
+      std::cout << "command latency max " << control_max
+        << " us within the bound of " << config.max_control_latency
+        << " us";
+      if (expected <= delivered)
+        std::cout << ", but no bulk frame was lost, so the bulk lane may"
+          " not have been saturated";
+      std::cout << "\n";
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -8,40 +8,129 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <array>
 #include <cstdlib>
-#include <deque>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 #include "asio.hpp"
 #include "chat_message.hpp"
+#include "handler_allocator.hpp"
+#include "kinect_command.hpp"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include "shm_channel.hpp"
+#include "uring.hpp"
+#endif
 
 using asio::ip::tcp;
+using asio::ip::udp;
 
-typedef std::deque<chat_message> chat_message_queue;
+typedef std::vector<chat_message> chat_message_queue;
 
 class chat_client
 {
 public:
+  // A relay on this machine that offers a shared-memory channel is used
+  // through it, and then nothing else applies. Otherwise, with use_uring
+  // the socket is connected here, synchronously, and run() drives it from
+  // an io_uring loop instead of the io_service. With udp_steering, steering
+  // commands go as datagrams if the relay offers it.
   chat_client(asio::io_service& io_service,
-      tcp::resolver::iterator endpoint_iterator)
+      tcp::resolver::iterator endpoint_iterator, bool use_uring = false,
+      bool udp_steering = false)
     : io_service_(io_service),
-      socket_(io_service)
+      socket_(io_service),
+      flush_pending_(false),
+      format_(chat_message::ascii_header),
+      sequence_(0),
+      udp_socket_(io_service),
+      udp_steering_(udp_steering)
+#if defined(__linux__)
+      , shm_open_(false),
+      shm_index_(0),
+      shm_offset_(0)
+#endif
   {
+    outbox_.reserve(max_write_batch);
+    flushing_.reserve(max_write_batch);
+    write_msgs_.reserve(max_write_batch);
+    writing_msgs_.reserve(max_write_batch);
+#if defined(__linux__)
+    if (start_shm(*endpoint_iterator))
+      return;
+    if (use_uring && uring::available())
+    {
+      asio::connect(socket_, endpoint_iterator);
+      start_uring();
+      return;
+    }
+    if (use_uring)
+      std::cerr << "io_uring is not available, using the asio reactor\n";
+#endif
     do_connect(endpoint_iterator);
   }
 
+  // Runs until the connection closes.
+  void run()
+  {
+#if defined(__linux__)
+    if (shm_)
+    {
+      run_shm();
+      return;
+    }
+    if (ring_)
+    {
+      run_uring();
+      return;
+    }
+#endif
+    io_service_.run();
+  }
+
+  // May be called from any thread. Messages wait in outbox_ until one
+  // posted handler moves them all to the write queue, so the handler does
+  // not carry a copy of the message and never needs the heap.
   void write(const chat_message& msg)
   {
-    io_service_.post(
-        [this, msg]()
-        {
-          bool write_in_progress = !write_msgs_.empty();
-          write_msgs_.push_back(msg);
-          if (!write_in_progress)
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    outbox_.push_back(msg);
+    if (flush_pending_)
+      return;
+    flush_pending_ = true;
+#if defined(__linux__)
+    if (shm_)
+    {
+      shm_->to_peer().interrupt();
+      return;
+    }
+    if (ring_)
+    {
+      std::uint64_t one = 1;
+      if (::write(wake_fd_, &one, sizeof(one)) < 0)
+        std::cerr << "[error] cannot wake the io_uring loop\n";
+      return;
+    }
+#endif
+    io_service_.post(make_custom_alloc_handler(flush_allocator_,
+          [this]()
           {
-            do_write();
-          }
-        });
+            flush_outbox();
+          }));
+  }
+
+  // Queued in binary form; prepare() falls back to the legacy text if the
+  // relay only speaks v1.
+  void write(const kinect_command& cmd)
+  {
+    chat_message msg(chat_message::binary_header);
+    cmd.encode(msg);
+    write(msg);
   }
 
   void close()
@@ -50,6 +139,14 @@ public:
   }
 
 private:
+  void disconnect()
+  {
+    socket_.close();
+#if defined(__linux__)
+    shm_open_ = false;
+#endif
+  }
+
   void do_connect(tcp::resolver::iterator endpoint_iterator)
   {
     asio::async_connect(socket_, endpoint_iterator,
@@ -57,107 +154,445 @@ private:
         {
           if (!ec)
           {
-            do_read_header();
+            send_hello();
+            do_read();
           }
         });
   }
 
-  void do_read_header()
+  // Announce protocol v2 with a v1 frame any relay can parse. Binary headers
+  // are only used once a binary frame comes back.
+  void send_hello()
   {
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec && read_msg_.decode_header())
-          {
-            do_read_body();
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
+    chat_message msg;
+    msg.make_hello();
+    bool write_in_progress = !writing_msgs_.empty();
+    write_msgs_.push_back(msg);
+    if (!write_in_progress)
+    {
+      do_write();
+    }
   }
 
-  void do_read_body()
+  void send_subscribe()
   {
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
-          {
-            if(strncmp(read_msg_.body(), "[kinect]", strlen("[kinect]")) == 0) {
-            std::cout.write(read_msg_.body(), read_msg_.body_length());
-            std::cout << "\n";
-            chat_message msg;
-            char msg_to_send_[chat_message::max_body_length] = "[kabuki] kinect message received";
-            msg.body_length(std::strlen(msg_to_send_));
-            std::memcpy(msg.body(), msg_to_send_, msg.body_length());
-            msg.encode_header();
-            write(msg);
-            } else if(strncmp(read_msg_.body(), "[kabuki]", strlen("[kabuki]")) == 0) {
-            std::cout << "[success] kabuki message sent";
-            std::cout << "\n";
-            } else {
-            std::cout << "[error] message " << "\"";
-            std::cout.write(read_msg_.body(), read_msg_.body_length());
-            std::cout << "\" not start with [kinect], discard";
-            std::cout << "\n";
-            }
-            do_read_header();
-          }
-          else
+    chat_message msg(chat_message::binary_header);
+    msg.make_subscribe(chat_message::command_topic);
+    bool write_in_progress = !writing_msgs_.empty();
+    write_msgs_.push_back(msg);
+    if (!write_in_progress)
+    {
+      do_write();
+    }
+  }
+
+  // Answers the relay's heartbeat, so that it keeps the session open.
+  void send_heartbeat()
+  {
+    chat_message msg(chat_message::binary_header);
+    msg.make_heartbeat();
+    bool write_in_progress = !writing_msgs_.empty();
+    write_msgs_.push_back(msg);
+    if (!write_in_progress)
+    {
+      do_write();
+    }
+  }
+
+  void flush_outbox()
+  {
+    {
+      std::lock_guard<std::mutex> lock(outbox_mutex_);
+      outbox_.swap(flushing_);
+      flush_pending_ = false;
+    }
+    bool write_in_progress = !writing_msgs_.empty();
+    for (auto& msg: flushing_)
+    {
+      if (send_datagram(msg))
+        continue;
+      write_msgs_.push_back(msg);
+      prepare(write_msgs_.back());
+    }
+    flushing_.clear();
+    if (!write_in_progress)
+    {
+      do_write();
+    }
+  }
+
+  // Brings a queued message into the connection's format.
+  void prepare(chat_message& msg)
+  {
+    if (format_ != chat_message::binary_header)
+    {
+      kinect_command cmd;
+      if (msg.format() == chat_message::binary_header && cmd.decode(msg))
+      {
+        msg.format(format_);
+        cmd.encode(msg);
+        msg.encode_header();
+      }
+      return;
+    }
+    msg.format(format_);
+    msg.sequence(++sequence_);
+    msg.encode_header();
+  }
+
+  // The relay's hello offered udp_steering. Datagrams go to the same
+  // address and port as the stream.
+  void open_steering_channel(std::uint32_t token)
+  {
+    asio::error_code ec;
+    tcp::endpoint relay = socket_.remote_endpoint(ec);
+    if (ec || token == 0)
+      return;
+    relay_udp_ = udp::endpoint(relay.address(), relay.port());
+    udp_socket_.open(relay_udp_.protocol(), ec);
+    if (ec)
+      return;
+    chat_store_le32(token_, token);
+    std::cout << "[udp] steering over datagrams\n";
+  }
+
+  // Sends a steering command as a datagram instead of queueing it, if the
+  // channel is open. Datagrams take their sequence from the same counter as
+  // the stream, so the relay drops one that arrives after a newer stop. A
+  // datagram that cannot be sent is lost, as it could be on the way.
+  bool send_datagram(chat_message& msg)
+  {
+    kinect_command cmd;
+    if (!udp_socket_.is_open() || msg.format() != chat_message::binary_header
+        || !cmd.decode(msg) || !kinect_command::steering(cmd.op()))
+      return false;
+    msg.sequence(++sequence_);
+    msg.encode_header();
+    std::array<asio::const_buffer, 2> buffers = {{
+      asio::buffer(token_), asio::buffer(msg.data(), msg.length()) }};
+    asio::error_code ec;
+    udp_socket_.send_to(buffers, relay_udp_, 0, ec);
+    return true;
+  }
+
+  // Reads whatever the socket has and handles every complete frame in it.
+  void do_read()
+  {
+#if defined(__linux__)
+    if (shm_)
+      return;
+    if (ring_)
+    {
+      if (read_fixed_)
+        ring_->prep_read_fixed(socket_.native_handle(),
+            read_buffer_.prepare(), read_buffer_.space(), 0, read_op);
+      else
+        ring_->prep_recv(socket_.native_handle(),
+            read_buffer_.prepare(), read_buffer_.space(), read_op);
+      return;
+    }
+#endif
+    socket_.async_read_some(
+        asio::buffer(read_buffer_.prepare(), read_buffer_.space()),
+        make_custom_alloc_handler(read_allocator_,
+          [this](std::error_code ec, std::size_t length)
           {
-            socket_.close();
-          }
-        });
+            if (!ec)
+              read_done(length);
+            else
+              socket_.close();
+          }));
+  }
+
+  void read_done(std::size_t length)
+  {
+    read_buffer_.commit(length);
+    chat_header header;
+    chat_read_buffer::parse_result result;
+    while ((result = read_buffer_.parse_header(header,
+            chat_message::max_body_length))
+        == chat_read_buffer::frame_ready)
+    {
+      std::size_t frame = header.header_size() + header.body_length();
+      if (read_buffer_.size() < frame)
+        break;
+      read_msg_.assign(header, read_buffer_.data());
+      read_buffer_.consume(frame);
+      handle_message();
+    }
+    if (result != chat_read_buffer::bad_frame)
+      do_read();
+    else
+      disconnect();
+  }
+
+  void handle_message()
+  {
+    if (read_msg_.format() == chat_message::binary_header)
+      format_ = chat_message::binary_header;
+    kinect_command cmd;
+    if(read_msg_.is_heartbeat()) {
+    send_heartbeat();
+    } else if(read_msg_.is_hello()) {
+    // the relay speaks v2, only ask for commands from now on
+    if(read_msg_.format() == chat_message::binary_header)
+      send_subscribe();
+    if(udp_steering_ && (read_msg_.flags() & chat_header::udp_steering))
+      open_steering_channel(read_msg_.hello_token(read_msg_.body()));
+    } else if(!cmd.decode(read_msg_)) {
+    std::cout << "[error] message " << "\"";
+    std::cout.write(read_msg_.body(), read_msg_.body_length());
+    std::cout << "\" not start with [kinect], discard";
+    std::cout << "\n";
+    } else if(cmd.op() != kinect_command::ack) {
+    std::cout << "[kinect] " << kinect_command::name(cmd.op());
+    std::cout << "\n";
+    write(kinect_command(kinect_command::ack));
+    } else {
+    std::cout << "[success] kabuki message sent";
+    std::cout << "\n";
+    }
   }
 
+  // Sends everything queued so far, up to max_write_batch frames, with one
+  // gathered async_write. The batch moves to writing_msgs_ so that messages
+  // queued while it is in flight cannot move it.
   void do_write()
   {
-    asio::async_write(socket_,
-        asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
+    if (write_msgs_.size() <= max_write_batch)
+    {
+      writing_msgs_.swap(write_msgs_);
+    }
+    else
+    {
+      writing_msgs_.assign(write_msgs_.begin(),
+          write_msgs_.begin() + max_write_batch);
+      write_msgs_.erase(write_msgs_.begin(),
+          write_msgs_.begin() + max_write_batch);
+    }
+#if defined(__linux__)
+    if (shm_)
+    {
+      shm_index_ = 0;
+      shm_offset_ = 0;
+      write_shm();
+      return;
+    }
+    if (ring_)
+    {
+      send_->clear();
+      for (auto& msg: writing_msgs_)
+        send_->push_back(msg.data(), msg.length());
+      send_->start(*ring_, socket_.native_handle(), write_op);
+      return;
+    }
+#endif
+    write_buffers_.clear();
+    for (auto& msg: writing_msgs_)
+      write_buffers_.push_back(asio::buffer(msg.data(), msg.length()));
+    asio::async_write(socket_, const_buffers_ref(write_buffers_),
+        make_custom_alloc_handler(write_allocator_,
+          [this](std::error_code ec, std::size_t /*length*/)
           {
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty())
-            {
-              do_write();
-            }
-          }
-          else
+            if (!ec)
+              write_done();
+            else
+              socket_.close();
+          }));
+  }
+
+  void write_done()
+  {
+    writing_msgs_.clear();
+    if (!write_msgs_.empty())
+    {
+      do_write();
+    }
+  }
+
+#if defined(__linux__)
+  enum { shm_retry_ms = 1, liveness_check_ms = 100 };
+
+  // Takes the relay's shared-memory channel if the relay is on this machine
+  // and offers one. The frames and the hello are the same as on TCP.
+  bool start_shm(const tcp::endpoint& relay)
+  {
+    if (!relay.address().is_loopback())
+      return false;
+    shm_ = shm_channel::attach(shm_channel::name_for_port(relay.port()));
+    if (!shm_)
+      return false;
+    shm_open_ = true;
+    std::cout << "[shm] local relay, using shared memory\n";
+    send_hello();
+    return true;
+  }
+
+  // Sleeps on the relay's ring between reads. write() from other threads
+  // interrupts the wait, and so does the relay letting go. A write the ring
+  // had no room for is tried again every shm_retry_ms.
+  void run_shm()
+  {
+    shm_ring& ring = shm_->to_peer();
+    while (shm_open_ && shm_->relay_alive())
+    {
+      std::uint32_t signal = ring.signal();
+      bool flush;
+      {
+        std::lock_guard<std::mutex> lock(outbox_mutex_);
+        flush = flush_pending_;
+      }
+      if (flush)
+        flush_outbox();
+      if (!writing_msgs_.empty())
+        write_shm();
+      char* p = read_buffer_.prepare();
+      std::size_t length = ring.read(p, read_buffer_.space());
+      if (length != 0)
+        read_done(length);
+      else if (!flush)
+        ring.wait(signal,
+            writing_msgs_.empty() ? liveness_check_ms : shm_retry_ms);
+    }
+  }
+
+  // Copies as much of the batch in writing_msgs_ as the relay's ring takes.
+  void write_shm()
+  {
+    shm_ring& ring = shm_->to_relay();
+    while (shm_index_ < writing_msgs_.size())
+    {
+      chat_message& msg = writing_msgs_[shm_index_];
+      shm_offset_ += ring.write(msg.data() + shm_offset_,
+          msg.length() - shm_offset_);
+      if (shm_offset_ < msg.length())
+        break;
+      shm_offset_ = 0;
+      ++shm_index_;
+    }
+    ring.notify();
+    if (shm_index_ == writing_msgs_.size())
+      write_done();
+  }
+
+  enum uring_operation { read_op = 1, write_op = 2, wake_op = 3 };
+
+  // read_buffer_ is registered with the ring once; if the kernel refuses,
+  // reads fall back to recv. write() from other threads wakes the loop
+  // through an eventfd the ring keeps a read on.
+  void start_uring()
+  {
+    ring_.reset(new uring(ring_entries));
+    send_.reset(new uring_send(max_write_batch));
+    wake_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (wake_fd_ < 0)
+      throw std::system_error(errno, std::system_category(), "eventfd");
+    iovec iov;
+    iov.iov_base = read_buffer_.prepare();
+    iov.iov_len = read_buffer_.capacity();
+    read_fixed_ = ring_->register_buffers(&iov, 1);
+    ring_->prep_read(wake_fd_, &wake_count_, sizeof(wake_count_), wake_op);
+    send_hello();
+    do_read();
+  }
+
+  void run_uring()
+  {
+    while (socket_.is_open())
+    {
+      ring_->submit_and_wait(1);
+      ring_->complete([this](std::uint64_t op, int result)
           {
-            socket_.close();
-          }
-        });
+            if (socket_.is_open())
+              uring_done(static_cast<uring_operation>(op), result);
+          });
+    }
+    ::close(wake_fd_);
   }
 
+  void uring_done(uring_operation op, int result)
+  {
+    int fd = socket_.native_handle();
+    if (op == wake_op)
+    {
+      ring_->prep_read(wake_fd_, &wake_count_, sizeof(wake_count_), wake_op);
+      flush_outbox();
+    }
+    else if (result <= 0)
+      socket_.close();
+    else if (op == read_op)
+      read_done(result);
+    else if (send_->sent(*ring_, fd, write_op, result))
+      write_done();
+  }
+#endif
+
 private:
+  enum { max_write_batch = 64 };
+  enum { ring_entries = 256 };
+
   asio::io_service& io_service_;
   tcp::socket socket_;
+  chat_read_buffer read_buffer_;
   chat_message read_msg_;
+  std::mutex outbox_mutex_;
+  chat_message_queue outbox_;
+  chat_message_queue flushing_;
+  bool flush_pending_;
   chat_message_queue write_msgs_;
+  chat_message_queue writing_msgs_;
+  std::vector<asio::const_buffer> write_buffers_;
+  handler_allocator read_allocator_;
+  handler_allocator write_allocator_;
+  handler_allocator flush_allocator_;
+  chat_message::header_format format_;
+  std::uint32_t sequence_;
+  udp::socket udp_socket_;
+  udp::endpoint relay_udp_;
+  char token_[chat_header::datagram_token_length];
+  bool udp_steering_;
+#if defined(__linux__)
+  std::unique_ptr<shm_channel> shm_;
+  bool shm_open_;
+  std::size_t shm_index_;
+  std::size_t shm_offset_;
+  std::unique_ptr<uring_send> send_;
+  int wake_fd_;
+  std::uint64_t wake_count_;
+  bool read_fixed_;
+  std::unique_ptr<uring> ring_; // last, so it goes before what it points at
+#endif
 };
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 3)
+    bool use_uring = false;
+    bool udp_steering = false;
+    int first_arg = 1;
+    for (; first_arg < argc && argv[first_arg][0] == '-'; ++first_arg)
+    {
+      if (std::strcmp(argv[first_arg], "--io-uring") == 0)
+        use_uring = true;
+      else if (std::strcmp(argv[first_arg], "--udp-steering") == 0)
+        udp_steering = true;
+      else
+        break;
+    }
+    if (argc - first_arg != 2)
     {
-      std::cerr << "Usage: chat_client <host> <port>\n";
+      std::cerr << "Usage: chat_client [--io-uring] [--udp-steering]"
+        " <host> <port>\n";
       return 1;
     }
+    char** args = argv + first_arg;
 
     asio::io_service io_service;
 
     tcp::resolver resolver(io_service);
-    auto endpoint_iterator = resolver.resolve({ argv[1], argv[2] });
-    chat_client c(io_service, endpoint_iterator);
+    auto endpoint_iterator = resolver.resolve({ args[0], args[1] });
+    chat_client c(io_service, endpoint_iterator, use_uring, udp_steering);
 
     /*std::thread t([&io_service](){ io_service.run(); });
 
@@ -170,7 +605,7 @@ int main(int argc, char* argv[])
       msg.encode_header();
       c.write(msg);
     }*/
-    io_service.run();
+    c.run();
 
     c.close();
     // t.join();
@@ -8,217 +8,2315 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
-#include <deque>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "asio.hpp"
-#include "chat_message.hpp"
+#include "handler_allocator.hpp"
+#include "relay_message.hpp"
+#include "relay_metrics.hpp"
+#include "timer_wheel.hpp"
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "shm_channel.hpp"
+#include "uring.hpp"
+#endif
 
 using asio::ip::tcp;
+using asio::ip::udp;
 
 //----------------------------------------------------------------------
 
-typedef std::deque<chat_message> chat_message_queue;
+#if defined(RELAY_COUNT_ALLOCATIONS)
+// Build with -DRELAY_COUNT_ALLOCATIONS, or make chat_server_counting, to
+// have --stats report every heap allocation. Once sessions are connected
+// and the pools are warm the count should stop moving while messages flow.
+// What --stats itself allocates is reported apart, as stats_allocations.
+void* operator new(std::size_t size)
+{
+  relay_metrics::instance().record_allocation();
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+#endif // defined(RELAY_COUNT_ALLOCATIONS)
+
+//----------------------------------------------------------------------
+
+// A vector rather than a deque: it keeps its capacity, so a warm queue
+// never allocates.
+typedef std::vector<relay_message_ptr> chat_message_queue;
+
+// How many unsent messages of each class a session holds for a slow peer
+// before it drops the oldest. Zero means no limit. Control messages are
+// never dropped. Runs of one command repeated by a peer are thinned to one
+// per coalesce_window; zero forwards every copy. A socket session is
+// checked every heartbeat_interval and closed once its peer has been
+// silent, or its write stuck, for idle_timeout; zero never closes it.
+struct queue_limits
+{
+  queue_limits()
+    : steering(1),
+      bulk(256),
+      coalesce_window(200),
+      heartbeat_interval(5000),
+      idle_timeout(15000),
+      send_buffer(0)
+  {
+  }
+
+  std::size_t steering;
+  std::size_t bulk;
+  std::chrono::milliseconds coalesce_window;
+  std::chrono::milliseconds heartbeat_interval;
+  std::chrono::milliseconds idle_timeout;
+  // SO_SNDBUF for sessions, 0 for the kernel's. Commands are written ahead
+  // of bulk frames still queued here, but not of bytes already in the
+  // socket, so this bounds how long a command can wait behind them.
+  std::size_t send_buffer;
+};
+
+//----------------------------------------------------------------------
+
+// The Kinect host repeats a command on every frame for as long as a gesture
+// is held. The first of a run is an edge and always goes through, as does
+// a different command or the same one after a pause of a window or more.
+// Within a run one copy per window goes through as a keep-alive, so the
+// robot still hears that the gesture is held. A button is a press rather
+// than a state and gets no keep-alives. Commands from one peer arrive over
+// its stream and over datagrams, hence the lock.
+class command_coalescer
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  command_coalescer()
+    : seen_(false)
+  {
+  }
+
+  // Whether cmd, received at now, should be forwarded.
+  bool pass(const kinect_command& cmd, clock::time_point now,
+      clock::duration window)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool edge = !seen_ || !same(cmd, last_) || now - last_seen_ >= window;
+    bool keep_alive = cmd.op() != kinect_command::button
+      && now - last_passed_ >= window;
+    seen_ = true;
+    last_ = cmd;
+    last_seen_ = now;
+    if (!edge && !keep_alive)
+      return false;
+    last_passed_ = now;
+    return true;
+  }
+
+private:
+  static bool same(const kinect_command& a, const kinect_command& b)
+  {
+    return a.op() == b.op() && a.twist() == b.twist()
+      && a.linear() == b.linear() && a.angular() == b.angular();
+  }
+
+  std::mutex mutex_;
+  bool seen_;
+  kinect_command last_;
+  clock::time_point last_seen_;
+  clock::time_point last_passed_;
+};
+
+//----------------------------------------------------------------------
+
+class chat_participant
+{
+public:
+  virtual ~chat_participant() {}
+  virtual void deliver(const relay_message_ptr& msg) = 0;
+
+  // Mask of chat_header::topic values this participant wants. May be read
+  // from any thread.
+  virtual std::uint32_t topics() const = 0;
+
+  // Writes this participant's metrics, labelled with the room's name, and
+  // exposes its deliver latency for the room's total. May be called from
+  // any thread while the participant is in the room.
+  virtual void dump_metrics(std::ostream& os, const std::string& room) const
+    = 0;
+  virtual const latency_histogram& deliver_latency() const = 0;
+};
+
+typedef std::shared_ptr<chat_participant> chat_participant_ptr;
+
+//----------------------------------------------------------------------
+
+// The last messages seen by a room, kept for debugging. The slots are
+// allocated once; a new message takes the place of the oldest.
+class chat_history
+{
+public:
+  explicit chat_history(std::size_t capacity)
+    : msgs_(capacity),
+      next_(0),
+      size_(0)
+  {
+  }
+
+  void push(const relay_message_ptr& msg)
+  {
+    if (msgs_.empty())
+      return;
+    msgs_[next_] = msg;
+    next_ = (next_ + 1) % msgs_.size();
+    if (size_ < msgs_.size())
+      ++size_;
+  }
+
+  // One line per message, oldest first.
+  void dump(std::ostream& os) const
+  {
+    if (size_ == 0)
+      return;
+    std::size_t first = (next_ + msgs_.size() - size_) % msgs_.size();
+    for (std::size_t i = 0; i < size_; ++i)
+    {
+      const relay_message& msg = *msgs_[(first + i) % msgs_.size()];
+      os << "history " << msg.native().sequence() << " topic "
+        << msg.topic() << " bytes " << msg.body_length() << "\n";
+    }
+  }
+
+private:
+  std::vector<relay_message_ptr> msgs_;
+  std::size_t next_;
+  std::size_t size_;
+};
+
+//----------------------------------------------------------------------
+
+// Membership and the caches are guarded by one mutex, so sessions on
+// different threads may join, leave and deliver at once. Participants only
+// queue work for their own strand from deliver(), which keeps the lock
+// short and gives every participant the room's messages in the same order.
+// A message only goes to participants subscribed to its topic, and never
+// back to the participant it came from. A participant that joins late gets
+// the last message of each topic it subscribes to, not the backlog.
+//
+// With --shards a room is split over one chat_room per shard, each holding
+// the participants of its own loop. Every message goes through the home
+// shard's room first, which hands it to the others in the order it took
+// them, so all shards agree on the order and on the cached last messages.
+class chat_room
+{
+public:
+  chat_room(std::size_t history_size, const std::string& name)
+    : name_(name),
+      history_(history_size),
+      home_(this),
+      io_service_(0),
+      forward_pending_(false)
+  {
+    inbox_.reserve(max_forward_batch);
+    forwarding_.reserve(max_forward_batch);
+  }
+
+  // Makes this room one shard of a larger one. io_service runs this shard;
+  // peers, given to the home room only, are the rooms of the other shards.
+  void link(asio::io_service& io_service, chat_room& home,
+      const std::vector<chat_room*>& peers)
+  {
+    io_service_ = &io_service;
+    home_ = &home;
+    peers_ = peers;
+  }
+
+  // Labels the room's metrics. Called before anyone joins.
+  void name(const std::string& name)
+  {
+    name_ = name;
+  }
+
+  void join(chat_participant_ptr participant)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_.insert(participant);
+    for (auto& msg: last_msgs_)
+    {
+      if (msg && (participant->topics() & msg->topic()) != 0)
+        participant->deliver(msg);
+    }
+  }
+
+  void leave(chat_participant_ptr participant)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_.erase(participant);
+  }
+
+  void deliver(const relay_message_ptr& msg, const chat_participant* origin)
+  {
+    if (home_ != this)
+    {
+      home_->forward(msg, origin);
+      return;
+    }
+    deliver_local(msg, origin);
+    for (auto peer: peers_)
+      peer->forward(msg, origin);
+  }
+
+  void dump_history(std::ostream& os)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    history_.dump(os);
+  }
+
+  void record_disconnect(disconnect_reason reason)
+  {
+    metrics_.record_disconnect(reason);
+  }
+
+  // The room's totals, then each participant's. The room's deliver latency
+  // covers the participants in it now.
+  void dump_metrics(std::ostream& os)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string labels = "room=\"" + name_ + "\"";
+    os << "room_participants{" << labels << "} " << participants_.size()
+      << "\n";
+    metrics_.dump(os, labels);
+    latency_histogram latency;
+    for (auto& participant: participants_)
+      latency.merge(participant->deliver_latency());
+    latency.dump(os, "room_deliver_latency_us", labels);
+    for (auto& participant: participants_)
+      participant->dump_metrics(os, name_);
+  }
+
+private:
+  enum { topic_count = 3 };
+  enum { max_forward_batch = 64 };
+
+  struct forwarded_message
+  {
+    relay_message_ptr msg;
+    const chat_participant* origin;
+  };
+
+  void deliver_local(const relay_message_ptr& msg,
+      const chat_participant* origin)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_msgs_[topic_slot(msg->topic())] = msg;
+    history_.push(msg);
+    metrics_.messages.add(1);
+
+    for (auto& participant: participants_)
+    {
+      if (participant.get() != origin
+          && (participant->topics() & msg->topic()) != 0)
+      {
+        participant->deliver(msg);
+        metrics_.deliveries.add(1);
+      }
+    }
+  }
+
+  // Called from another shard's thread. As in chat_session::deliver(), one
+  // posted handler takes everything that arrived since the last one. The
+  // origin is only compared, never followed, on the shard it came from.
+  void forward(const relay_message_ptr& msg, const chat_participant* origin)
+  {
+    std::lock_guard<std::mutex> lock(inbox_mutex_);
+    forwarded_message f = { msg, origin };
+    inbox_.push_back(f);
+    if (forward_pending_)
+      return;
+    forward_pending_ = true;
+    io_service_->post(make_custom_alloc_handler(forward_allocator_,
+          [this]()
+          {
+            {
+              std::lock_guard<std::mutex> lock(inbox_mutex_);
+              inbox_.swap(forwarding_);
+              forward_pending_ = false;
+            }
+            for (auto& f: forwarding_)
+            {
+              if (home_ == this)
+                deliver(f.msg, f.origin);
+              else
+                deliver_local(f.msg, f.origin);
+            }
+            forwarding_.clear();
+          }));
+  }
+
+  static std::size_t topic_slot(chat_header::topic t)
+  {
+    return t == chat_header::command_topic ? 1
+      : t == chat_header::ack_topic ? 2 : 0;
+  }
+
+  std::string name_;
+  std::mutex mutex_;
+  std::set<chat_participant_ptr> participants_;
+  relay_message_ptr last_msgs_[topic_count];
+  chat_history history_;
+  room_metrics metrics_;
+  chat_room* home_;
+  std::vector<chat_room*> peers_;
+  asio::io_service* io_service_;
+  std::mutex inbox_mutex_;
+  std::vector<forwarded_message> inbox_;
+  std::vector<forwarded_message> forwarding_;
+  bool forward_pending_;
+  handler_allocator forward_allocator_;
+};
+
+//----------------------------------------------------------------------
+
+class relay_session;
+
+// Datagram tokens handed out in relay hellos, so that a steering datagram
+// can be matched with the session it belongs to. Random, and never 0.
+class steering_tokens
+{
+public:
+  static steering_tokens& instance()
+  {
+    static steering_tokens tokens;
+    return tokens;
+  }
+
+  std::uint32_t add(const std::shared_ptr<relay_session>& session)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::uint32_t token;
+    do
+      token = static_cast<std::uint32_t>(random_());
+    while (token == 0 || sessions_.count(token) != 0);
+    sessions_[token] = session;
+    return token;
+  }
+
+  void remove(std::uint32_t token)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sessions_.erase(token);
+  }
+
+  std::shared_ptr<relay_session> find(std::uint32_t token)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto i = sessions_.find(token);
+    if (i == sessions_.end())
+      return std::shared_ptr<relay_session>();
+    return i->second.lock();
+  }
+
+private:
+  steering_tokens()
+    : random_(std::random_device()())
+  {
+  }
+
+  std::mutex mutex_;
+  std::mt19937 random_;
+  std::unordered_map<std::uint32_t, std::weak_ptr<relay_session>> sessions_;
+};
+
+//----------------------------------------------------------------------
+
+// Framing, negotiation and the write queue of one relay connection, apart
+// from how bytes reach the socket. A transport feeds what it reads through
+// read_buffer_ and handle_frames(), and writes the batches take_batch()
+// hands it. Everything here runs in the session's own serial context: a
+// strand for asio, or the loop thread for io_uring.
+// Unsent messages wait in one of two lanes, subject to limits_, and each
+// batch drains the command lane before it takes anything from the bulk
+// lane, so a stop or a button press never waits behind queued telemetry.
+// Control and steering share a lane and keep their order: a stop is not
+// overtaken by the steering it was sent to end. writing_msgs_ holds the
+// batch in flight.
+class relay_session
+  : public chat_participant,
+    public std::enable_shared_from_this<relay_session>
+{
+public:
+  ~relay_session()
+  {
+    if (token_ != 0)
+      steering_tokens::instance().remove(token_);
+    if (dropped_ != 0)
+      std::cerr << "session dropped " << dropped_
+        << " messages, queue high water " << high_water_ << "\n";
+  }
+
+  std::uint32_t topics() const
+  {
+    return topics_.load(std::memory_order_relaxed);
+  }
+
+  void dump_metrics(std::ostream& os, const std::string& room) const
+  {
+    std::ostringstream labels;
+    labels << "room=\"" << room << "\",session=\"" << id_
+      << "\",peer=\"" << peer_ << "\"";
+    metrics_.dump(os, labels.str());
+    os << "session_connected_seconds{" << labels.str() << "} "
+      << std::chrono::duration_cast<std::chrono::seconds>(
+          std::chrono::steady_clock::now() - connected_).count() << "\n";
+  }
+
+  const latency_histogram& deliver_latency() const
+  {
+    return metrics_.deliver_latency;
+  }
+
+  // Lets a v2 peer send steering commands as datagrams. Called before the
+  // session starts.
+  void offer_udp_steering()
+  {
+    offer_udp_ = true;
+  }
+
+  // Takes the sequence of a binary frame from the peer, over either
+  // channel. Returns false if something as new has already been seen,
+  // in which case a datagram is stale. May be called from any thread.
+  bool advance_sequence(std::uint32_t sequence)
+  {
+    std::uint32_t last = last_sequence_.load(std::memory_order_relaxed);
+    do
+    {
+      if (static_cast<std::int32_t>(sequence - last) <= 0)
+        return false;
+    }
+    while (!last_sequence_.compare_exchange_weak(last, sequence,
+          std::memory_order_relaxed));
+    return true;
+  }
+
+  // Takes a command from the peer, over either channel, and returns false
+  // if it repeats the run it belongs to and should not be forwarded. May
+  // be called from any thread.
+  bool pass_command(const kinect_command& cmd)
+  {
+    if (limits_.coalesce_window.count() == 0 || cmd.op() == kinect_command::ack)
+      return true;
+    bool pass = coalescer_.pass(cmd, command_coalescer::clock::now(),
+        limits_.coalesce_window);
+    relay_metrics::instance().record_command(pass);
+    return pass;
+  }
+
+protected:
+  enum { max_write_batch = 64 };
+  enum { read_buffer_size = 8192 };
+
+  relay_session(chat_room& room, const queue_limits& limits)
+    : room_(room),
+      read_buffer_(read_buffer_size),
+      limits_(limits),
+      dropped_(0),
+      too_large_(0),
+      high_water_(0),
+      peer_format_(chat_message::ascii_header),
+      peer_max_body_(chat_header::legacy_max_body_length),
+      topics_(chat_header::all_topics),
+      offer_udp_(false),
+      token_(0),
+      last_sequence_(0),
+      id_(next_id()),
+      connected_(std::chrono::steady_clock::now()),
+      heard_(connected_),
+      left_(false)
+  {
+    for (auto& n: unsent_)
+      n = 0;
+    // Room for full lanes plus a batch's worth of control messages, so
+    // that steady traffic does not grow them.
+    lanes_[command_lane].reserve(limits_.steering + max_write_batch);
+    lanes_[bulk_lane].reserve(limits_.bulk + max_write_batch);
+    writing_msgs_.reserve(max_write_batch);
+  }
+
+  // What the session's queues hold before they grow: full lanes plus a
+  // batch in flight.
+  std::size_t queue_capacity() const
+  {
+    return limits_.steering + limits_.bulk + max_write_batch;
+  }
+
+  // Starts writing the batch take_batch() returns. Only called when no
+  // write is in flight and something is queued.
+  virtual void start_write() = 0;
+
+  // Reads the rest of read_msg_'s body, from body() + have on, then calls
+  // handle_message() and goes back to reading frames.
+  virtual void read_body(std::size_t have) = 0;
+
+  // Names the peer in the session's metrics. Called before the session
+  // starts.
+  void peer_name(const std::string& name)
+  {
+    peer_ = name;
+  }
+
+  void peer_name(const tcp::endpoint& endpoint)
+  {
+    std::ostringstream os;
+    os << endpoint;
+    peer_ = os.str();
+  }
+
+  void record_read(std::size_t frames, std::size_t bytes)
+  {
+    heard_ = std::chrono::steady_clock::now();
+    relay_metrics::instance().record_read(frames, bytes);
+    metrics_.frames_in.add(frames);
+    metrics_.bytes_in.add(bytes);
+  }
+
+  void record_write(std::size_t messages, std::size_t bytes)
+  {
+    relay_metrics::instance().record_write(messages, bytes);
+    metrics_.messages_out.add(messages);
+    metrics_.bytes_out.add(bytes);
+  }
+
+  // Leaves the room, the first time only, counting why.
+  void leave(disconnect_reason reason)
+  {
+    if (left_)
+      return;
+    left_ = true;
+    room_.record_disconnect(reason);
+    room_.leave(shared_from_this());
+  }
+
+  // Called every heartbeat interval. Leaves the room and returns false if
+  // a v2 peer has been silent for the idle timeout, or any peer has not
+  // taken a write for as long. Otherwise sends a heartbeat to a v2 peer
+  // that was silent for the last interval.
+  bool check_idle()
+  {
+    if (left_)
+      return false;
+    std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+    bool v2 = peer_format_ == chat_message::binary_header;
+    if ((v2 && now - heard_ >= limits_.idle_timeout)
+        || (!writing_msgs_.empty()
+          && now - write_started_ >= limits_.idle_timeout))
+    {
+      leave(idle_timeout);
+      return false;
+    }
+    if (v2 && now - heard_ >= limits_.heartbeat_interval)
+      queue(heartbeat());
+    return true;
+  }
+
+  // Every heartbeat is the same frame, so all sessions share one.
+  static const relay_message_ptr& heartbeat()
+  {
+    static const relay_message_ptr msg = []()
+    {
+      chat_message heartbeat(chat_message::binary_header);
+      heartbeat.make_heartbeat();
+      return make_relay_message(pooled_message(heartbeat));
+    }();
+    return msg;
+  }
+
+  void queue(const relay_message_ptr& msg)
+  {
+    // Peers that never said otherwise only take 512-byte bodies. What they
+    // cannot take is dropped and counted like a message that did not fit
+    // the queue.
+    if (msg->body_length() > peer_max_body_)
+    {
+      if (too_large_++ == 0)
+        std::cerr << "peer takes bodies up to " << peer_max_body_
+          << " bytes, dropping a " << msg->body_length() << "-byte message\n";
+      ++dropped_;
+      metrics_.dropped.add(1);
+      relay_metrics::instance().record_too_large();
+      return;
+    }
+
+    relay_message::traffic_class c = msg->traffic();
+    std::size_t limit = c == relay_message::steering_class ? limits_.steering
+      : c == relay_message::bulk_class ? limits_.bulk : 0;
+    if (limit != 0 && unsent_[c] >= limit)
+      drop_oldest_unsent(c);
+
+    bool write_in_progress = !writing_msgs_.empty();
+    lanes_[lane_of(c)].push_back(msg);
+    ++unsent_[c];
+    std::size_t depth = queue_depth();
+    metrics_.queue_depth.set(depth);
+    if (depth > high_water_)
+    {
+      high_water_ = depth;
+      metrics_.queue_high_water.set(high_water_);
+      relay_metrics::instance().record_queue_depth(high_water_);
+    }
+    if (!write_in_progress)
+    {
+      start_write();
+    }
+  }
+
+  // Handles every complete frame in read_buffer_. Returns false if
+  // read_body() was called for a large body, or the session is going away.
+  // frames counts the messages handled.
+  bool handle_frames(std::size_t& frames)
+  {
+    chat_header header;
+    for (;;)
+    {
+      chat_read_buffer::parse_result result = read_buffer_.parse_header(
+          header, pooled_message::max_body_length());
+      if (result == chat_read_buffer::bad_frame)
+      {
+        leave(bad_frame);
+        return false;
+      }
+      if (result == chat_read_buffer::need_more)
+        return true;
+
+      std::size_t frame = header.header_size() + header.body_length();
+      if (read_buffer_.size() < frame
+          && frame <= read_buffer_.capacity())
+        return true;
+
+      read_msg_.assign_header(header);
+      if (read_buffer_.size() < frame)
+      {
+        std::size_t have = read_buffer_.size() - header.header_size();
+        std::memcpy(read_msg_.body(),
+            read_buffer_.data() + header.header_size(), have);
+        read_buffer_.consume(read_buffer_.size());
+        read_body(have);
+        return false;
+      }
+
+      std::memcpy(read_msg_.body(),
+          read_buffer_.data() + header.header_size(), header.body_length());
+      read_buffer_.consume(frame);
+      handle_message();
+      ++frames;
+    }
+  }
+
+  void handle_message()
+  {
+    if (read_msg_.is_hello())
+    {
+      accept_hello();
+    }
+    else if (read_msg_.format() == chat_message::binary_header
+        && read_msg_.type() == chat_message::subscribe_type)
+    {
+      topics_.store(read_msg_.subscribed_topics(read_msg_.body()),
+          std::memory_order_relaxed);
+    }
+    else if (read_msg_.is_heartbeat())
+    {
+      // Only says the peer is there, which record_read() has noted.
+    }
+    else
+    {
+      // Anyone who sends a binary header can also read one.
+      if (read_msg_.format() == chat_message::binary_header)
+      {
+        peer_format_ = chat_message::binary_header;
+        advance_sequence(read_msg_.sequence());
+      }
+      kinect_command cmd;
+      if (cmd.decode(read_msg_) && !pass_command(cmd))
+        return;
+      room_.deliver(make_relay_message(std::move(read_msg_)), this);
+    }
+  }
+
+  // Moves up to max_write_batch queued messages, and about
+  // max_write_bytes, into writing_msgs_, command lane first, and calls
+  // f(const pooled_message&) with each, encoded for this peer. The byte
+  // limit bounds how long a command queued from now on waits for the
+  // batch ahead of it.
+  template <typename Function>
+  void take_batch(Function f)
+  {
+    write_started_ = std::chrono::steady_clock::now();
+    std::size_t bytes = 0;
+    for (auto& lane: lanes_)
+    {
+      std::size_t n = 0;
+      while (n < lane.size() && writing_msgs_.size() < max_write_batch
+          && (writing_msgs_.empty() || bytes < max_write_bytes))
+      {
+        const pooled_message& msg = lane[n]->encoded(peer_format_);
+        f(msg);
+        bytes += msg.length();
+        --unsent_[lane[n]->traffic()];
+        writing_msgs_.push_back(std::move(lane[n]));
+        ++n;
+      }
+      lane.erase(lane.begin(), lane.begin() + n);
+    }
+  }
+
+  // The batch in flight has been written. Returns true if more is queued.
+  bool batch_written()
+  {
+    std::chrono::steady_clock::time_point now
+      = std::chrono::steady_clock::now();
+    for (auto& msg: writing_msgs_)
+      metrics_.deliver_latency.record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            now - msg->received()).count());
+    writing_msgs_.clear();
+    metrics_.queue_depth.set(queue_depth());
+    return queue_depth() != 0;
+  }
+
+  chat_room& room_;
+  chat_read_buffer read_buffer_;
+  pooled_message read_msg_;
+
+private:
+  static std::uint64_t next_id()
+  {
+    static std::atomic<std::uint64_t> id(0);
+    return ++id;
+  }
+
+  enum lane { command_lane, bulk_lane, lane_count };
+  enum { max_write_bytes = 64 * 1024 };
+
+  static lane lane_of(relay_message::traffic_class c)
+  {
+    return c == relay_message::bulk_class ? bulk_lane : command_lane;
+  }
+
+  std::size_t queue_depth() const
+  {
+    return writing_msgs_.size() + lanes_[command_lane].size()
+      + lanes_[bulk_lane].size();
+  }
+
+  // Removing the old entry rather than overwriting it keeps a newer steering
+  // command behind any stop queued after the one it replaces.
+  void drop_oldest_unsent(relay_message::traffic_class c)
+  {
+    chat_message_queue& unsent = lanes_[lane_of(c)];
+    for (auto i = unsent.begin(); i != unsent.end(); ++i)
+    {
+      if ((*i)->traffic() == c)
+      {
+        unsent.erase(i);
+        --unsent_[c];
+        ++dropped_;
+        metrics_.dropped.add(1);
+        metrics_.queue_depth.set(queue_depth());
+        relay_metrics::instance().record_drop(
+            c == relay_message::steering_class);
+        return;
+      }
+    }
+  }
+
+  // The peer speaks protocol v2. Answer with a binary hello, which tells it
+  // that this end does too, and use binary headers from now on. Hellos are
+  // not forwarded to the room.
+  void accept_hello()
+  {
+    peer_format_ = chat_message::binary_header;
+    peer_max_body_ = read_msg_.hello_max_body(read_msg_.body());
+    chat_message reply(chat_message::binary_header);
+    reply.type(chat_message::hello_type);
+    if (offer_udp_ && token_ == 0)
+      token_ = steering_tokens::instance().add(shared_from_this());
+    if (token_ != 0)
+      reply.flags(chat_header::udp_steering);
+    reply.body_length(chat_header::encode_hello(reply.body(),
+          pooled_message::max_body_length(), token_));
+    reply.encode_header();
+    queue(make_relay_message(pooled_message(reply)));
+  }
+
+  const queue_limits& limits_;
+  chat_message_queue lanes_[lane_count];
+  chat_message_queue writing_msgs_;
+  std::size_t unsent_[relay_message::traffic_classes];
+  std::size_t dropped_;
+  std::size_t too_large_;
+  std::size_t high_water_;
+  chat_message::header_format peer_format_;
+  std::size_t peer_max_body_;
+  std::atomic<std::uint32_t> topics_;
+  bool offer_udp_;
+  std::uint32_t token_;
+  std::atomic<std::uint32_t> last_sequence_;
+  command_coalescer coalescer_;
+  std::uint64_t id_;
+  std::string peer_;
+  std::chrono::steady_clock::time_point connected_;
+  std::chrono::steady_clock::time_point heard_;
+  std::chrono::steady_clock::time_point write_started_;
+  session_metrics metrics_;
+  bool left_;
+};
+
+//----------------------------------------------------------------------
+
+// A session on an asio io_service, whose handlers all run on its strand.
+// deliver() may be called from any thread: it adds to inbox_ and posts at
+// most one handler to move the inbox to the write queue, so the hop never
+// needs more than the one block in deliver_allocator_.
+class strand_session
+  : public relay_session
+{
+public:
+  void start()
+  {
+    auto self(shared_from_this());
+    strand_.dispatch(
+        [this, self]()
+        {
+          room_.join(self);
+          do_read();
+        });
+  }
+
+  void deliver(const relay_message_ptr& msg)
+  {
+    std::lock_guard<std::mutex> lock(inbox_mutex_);
+    inbox_.push_back(msg);
+    if (deliver_pending_)
+      return;
+    deliver_pending_ = true;
+    auto self(shared_from_this());
+    strand_.post(make_custom_alloc_handler(deliver_allocator_,
+          [this, self]()
+          {
+            {
+              std::lock_guard<std::mutex> lock(inbox_mutex_);
+              inbox_.swap(delivering_);
+              deliver_pending_ = false;
+            }
+            for (auto& msg: delivering_)
+              queue(msg);
+            delivering_.clear();
+          }));
+  }
+
+protected:
+  strand_session(asio::io_service& io_service, chat_room& room,
+      const queue_limits& limits)
+    : relay_session(room, limits),
+      strand_(io_service),
+      deliver_pending_(false)
+  {
+    inbox_.reserve(queue_capacity());
+    delivering_.reserve(queue_capacity());
+  }
+
+  // Starts reading, on the strand, once the session has joined the room.
+  virtual void do_read() = 0;
+
+  asio::io_service::strand strand_;
+
+private:
+  std::mutex inbox_mutex_;
+  chat_message_queue inbox_;
+  chat_message_queue delivering_;
+  bool deliver_pending_;
+  handler_allocator deliver_allocator_;
+};
+
+// The socket transport. A session on a server with an idle timeout is
+// checked by the server's timer wheel every heartbeat interval, on its
+// strand, and closes its socket once it has left for being idle.
+class chat_session
+  : public strand_session
+{
+public:
+  typedef timer_wheel<chat_session> wheel;
+
+  chat_session(asio::io_service& io_service, tcp::socket socket,
+      chat_room& room, const queue_limits& limits)
+    : strand_session(io_service, room, limits),
+      socket_(std::move(socket)),
+      wheel_(0)
+  {
+    write_buffers_.reserve(max_write_batch);
+    asio::error_code ec;
+    if (limits.send_buffer != 0)
+      socket_.set_option(asio::socket_base::send_buffer_size(
+            static_cast<int>(limits.send_buffer)), ec);
+    tcp::endpoint peer = socket_.remote_endpoint(ec);
+    if (!ec)
+      peer_name(peer);
+  }
+
+  // Starts the idle checks. Called once, after start().
+  void watch(wheel& w, std::chrono::milliseconds interval)
+  {
+    wheel_ = &w;
+    interval_ = interval;
+    w.schedule(self(), interval_);
+  }
+
+  void timer_expired()
+  {
+    auto self(this->self());
+    strand_.post(make_custom_alloc_handler(idle_allocator_,
+          [this, self]()
+          {
+            if (check_idle())
+              wheel_->schedule(self, interval_);
+            else
+              socket_.close();
+          }));
+  }
+
+private:
+  std::shared_ptr<chat_session> self()
+  {
+    return std::static_pointer_cast<chat_session>(shared_from_this());
+  }
+
+  // Reads whatever the socket has and handles every complete frame in it.
+  void do_read()
+  {
+    auto self(shared_from_this());
+    socket_.async_read_some(
+        asio::buffer(read_buffer_.prepare(), read_buffer_.space()),
+        strand_.wrap(make_custom_alloc_handler(read_allocator_,
+          [this, self](std::error_code ec, std::size_t length)
+          {
+            if (!ec)
+            {
+              read_buffer_.commit(length);
+              std::size_t frames = 0;
+              bool more = handle_frames(frames);
+              record_read(frames, length);
+              if (more)
+                do_read();
+            }
+            else
+            {
+              leave(read_failure(ec));
+            }
+          })));
+  }
+
+  void read_body(std::size_t have)
+  {
+    auto self(shared_from_this());
+    asio::async_read(socket_,
+        asio::buffer(read_msg_.body() + have, read_msg_.body_length() - have),
+        strand_.wrap(make_custom_alloc_handler(read_allocator_,
+          [this, self](std::error_code ec, std::size_t /*length*/)
+          {
+            if (!ec)
+            {
+              handle_message();
+              do_read();
+            }
+            else
+            {
+              leave(read_failure(ec));
+            }
+          })));
+  }
+
+  // Gathers the batch into one async_write.
+  void start_write()
+  {
+    auto self(shared_from_this());
+    write_buffers_.clear();
+    take_batch([this](const pooled_message& msg)
+        {
+          write_buffers_.push_back(asio::buffer(msg.data(), msg.length()));
+        });
+    asio::async_write(socket_, const_buffers_ref(write_buffers_),
+        strand_.wrap(make_custom_alloc_handler(write_allocator_,
+          [this, self](std::error_code ec, std::size_t length)
+          {
+            if (!ec)
+            {
+              record_write(write_buffers_.size(), length);
+              if (batch_written())
+              {
+                start_write();
+              }
+            }
+            else
+            {
+              leave(write_error);
+            }
+          })));
+  }
+
+  static disconnect_reason read_failure(const std::error_code& ec)
+  {
+    return ec == asio::error_code(asio::error::eof) ? peer_closed
+      : read_error;
+  }
+
+  tcp::socket socket_;
+  std::vector<asio::const_buffer> write_buffers_;
+  wheel* wheel_;
+  std::chrono::milliseconds interval_;
+  handler_allocator read_allocator_;
+  handler_allocator write_allocator_;
+  handler_allocator idle_allocator_;
+};
+
+//----------------------------------------------------------------------
+
+#if defined(SO_REUSEPORT)
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+  reuse_port;
+#endif
+
+// Steering datagrams sent to one port (see chat_message.hpp). A lost
+// datagram holds up nothing behind it, and one that arrives after anything
+// newer from its session is dropped. Only steering commands are taken this
+// way; stop and button must come over the session's TCP stream.
+class steering_receiver
+{
+public:
+  steering_receiver(asio::io_service& io_service,
+      const udp::endpoint& endpoint, chat_room& room, bool share_port)
+    : socket_(io_service),
+      room_(room)
+  {
+    socket_.open(endpoint.protocol());
+#if defined(SO_REUSEPORT)
+    if (share_port)
+      socket_.set_option(reuse_port(true));
+#endif
+    socket_.bind(endpoint);
+    do_receive();
+  }
+
+private:
+  enum
+  {
+    max_datagram_length = chat_header::datagram_token_length
+      + chat_header::binary_header_length + kinect_command::max_length
+  };
+
+  void do_receive()
+  {
+    socket_.async_receive_from(asio::buffer(buffer_), sender_,
+        make_custom_alloc_handler(allocator_,
+          [this](std::error_code ec, std::size_t length)
+          {
+            if (!ec)
+              handle_datagram(length);
+            if (socket_.is_open())
+              do_receive();
+          }));
+  }
+
+  void handle_datagram(std::size_t length)
+  {
+    const char* frame = buffer_ + chat_header::datagram_token_length;
+    std::size_t max_body = pooled_message::max_body_length();
+    chat_header header;
+    if (length < chat_header::datagram_token_length
+          + chat_header::binary_header_length
+        || !header.decode_header(frame, max_body)
+        || header.format() != chat_header::binary_header
+        || !header.decode_binary_header(frame, max_body)
+        || header.type() != chat_header::command_type
+        || chat_header::datagram_token_length + header.header_size()
+          + header.body_length() != length)
+      return;
+
+    kinect_command cmd;
+    const char* body = frame + header.header_size();
+    if (!cmd.decode(body, header.body_length())
+        || !kinect_command::steering(cmd.op()))
+      return;
+
+    std::shared_ptr<relay_session> session =
+      steering_tokens::instance().find(chat_load_le32(buffer_));
+    if (!session)
+      return;
+    bool fresh = session->advance_sequence(header.sequence());
+    relay_metrics::instance().record_datagram(fresh);
+    if (!fresh || !session->pass_command(cmd))
+      return;
+
+    pooled_message msg(chat_header::binary_header);
+    msg.assign_header(header);
+    std::memcpy(msg.body(), body, header.body_length());
+    room_.deliver(make_relay_message(std::move(msg)), session.get());
+  }
+
+  udp::socket socket_;
+  chat_room& room_;
+  udp::endpoint sender_;
+  char buffer_[max_datagram_length];
+  handler_allocator allocator_;
+};
+
+//----------------------------------------------------------------------
+
+class chat_server
+{
+public:
+  // With udp_steering, v2 peers may also send steering commands as
+  // datagrams to the same port number. With share_port, several servers
+  // may listen on the same endpoint and the kernel spreads the connections,
+  // and datagram senders, between them.
+  chat_server(asio::io_service& io_service,
+      const tcp::endpoint& endpoint, const queue_limits& limits,
+      std::size_t history_size, bool udp_steering = false,
+      bool share_port = false)
+    : io_service_(io_service),
+      limits_(limits),
+      acceptor_(io_service),
+      socket_(io_service),
+      room_(history_size, std::to_string(endpoint.port()))
+  {
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+    if (share_port)
+      acceptor_.set_option(reuse_port(true));
+#endif
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    if (limits.idle_timeout.count() != 0)
+      wheel_.reset(new chat_session::wheel(io_service,
+            std::chrono::milliseconds(idle_tick_ms)));
+    if (udp_steering)
+      steering_.reset(new steering_receiver(io_service,
+            udp::endpoint(endpoint.address(), endpoint.port()), room_,
+            share_port));
+    do_accept();
+  }
+
+  chat_room& room()
+  {
+    return room_;
+  }
+
+  void dump_history(std::ostream& os)
+  {
+    room_.dump_history(os);
+  }
+
+  void dump_metrics(std::ostream& os)
+  {
+    room_.dump_metrics(os);
+  }
+
+private:
+  enum { idle_tick_ms = 100 };
+
+  void do_accept()
+  {
+    acceptor_.async_accept(socket_,
+        [this](std::error_code ec)
+        {
+          if (!ec)
+          {
+            auto session = std::make_shared<chat_session>(io_service_,
+                std::move(socket_), room_, limits_);
+            if (steering_)
+              session->offer_udp_steering();
+            session->start();
+            if (wheel_)
+              session->watch(*wheel_, limits_.heartbeat_interval);
+          }
+
+          do_accept();
+        });
+  }
+
+  asio::io_service& io_service_;
+  const queue_limits& limits_;
+  tcp::acceptor acceptor_;
+  tcp::socket socket_;
+  chat_room room_;
+  std::unique_ptr<steering_receiver> steering_;
+  std::unique_ptr<chat_session::wheel> wheel_;
+};
+
+//----------------------------------------------------------------------
+
+// Serves the metrics over HTTP on a loopback port, one fresh snapshot per
+// request, so a scraper or curl can watch the relay while it runs. The
+// text is in the Prometheus exposition format. What it allocates is counted
+// as stats output, not as message-path allocations.
+class metrics_endpoint
+{
+public:
+  metrics_endpoint(asio::io_service& io_service, unsigned short port,
+      const std::function<void(std::ostream&)>& render)
+    : acceptor_(io_service,
+          tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+      socket_(io_service),
+      render_(render)
+  {
+    do_accept();
+  }
+
+private:
+  // One request per connection. The reply goes out once the request has
+  // been read, so that closing does not reset it.
+  struct exchange
+  {
+    explicit exchange(tcp::socket socket)
+      : socket(std::move(socket))
+    {
+    }
+
+    tcp::socket socket;
+    char request[1024];
+    std::string reply;
+  };
+
+  void do_accept()
+  {
+    acceptor_.async_accept(socket_,
+        [this](std::error_code ec)
+        {
+          relay_metrics::dump_scope scope;
+          if (!ec)
+            serve(std::make_shared<exchange>(std::move(socket_)));
+          do_accept();
+        });
+  }
 
-//----------------------------------------------------------------------
+  void serve(const std::shared_ptr<exchange>& e)
+  {
+    e->socket.async_read_some(asio::buffer(e->request),
+        [this, e](std::error_code ec, std::size_t /*length*/)
+        {
+          if (ec)
+            return;
+          relay_metrics::dump_scope scope;
+          std::ostringstream body;
+          render_(body);
+          e->reply = "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.str().size())
+            + "\r\n\r\n" + body.str();
+          asio::async_write(e->socket, asio::buffer(e->reply),
+              [e](std::error_code, std::size_t)
+              {
+                asio::error_code ignored;
+                e->socket.shutdown(tcp::socket::shutdown_both, ignored);
+              });
+        });
+  }
 
-class chat_participant
-{
-public:
-  virtual ~chat_participant() {}
-  virtual void deliver(const chat_message& msg) = 0;
+  tcp::acceptor acceptor_;
+  tcp::socket socket_;
+  std::function<void(std::ostream&)> render_;
 };
 
-typedef std::shared_ptr<chat_participant> chat_participant_ptr;
-
 //----------------------------------------------------------------------
 
-class chat_room
+// Keeps the calling thread on one core, where the platform allows it.
+inline void pin_to_core(std::size_t core)
+{
+#if defined(__linux__)
+  std::size_t cores = std::thread::hardware_concurrency();
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cores ? core % cores : 0, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+// One io_service per shard, each run by a single thread on its own core,
+// and on every port one acceptor per shard sharing it through SO_REUSEPORT.
+// A session stays on the shard that accepted it. The home of a port's room
+// is shard (port index % shards), so ordering the traffic of different
+// ports falls to different cores. Shard 0 runs on the caller's io_service.
+class sharded_server
 {
 public:
-  void join(chat_participant_ptr participant)
+  sharded_server(asio::io_service& io_service, std::size_t shard_count)
+    : ports_(0)
   {
-    participants_.insert(participant);
-    for (auto msg: recent_msgs_)
-      participant->deliver(msg);
+    services_.push_back(&io_service);
+    for (std::size_t i = 1; i < shard_count; ++i)
+    {
+      owned_services_.emplace_back(new asio::io_service);
+      services_.push_back(owned_services_.back().get());
+    }
+    shards_.resize(shard_count);
   }
 
-  void leave(chat_participant_ptr participant)
+  // Returns shard 0's server for the port.
+  chat_server& listen(const tcp::endpoint& endpoint,
+      const queue_limits& limits, std::size_t history_size,
+      bool udp_steering)
   {
-    participants_.erase(participant);
+    std::vector<chat_room*> rooms;
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+    {
+      shards_[i].emplace_back(*services_[i], endpoint, limits,
+          history_size, udp_steering, true);
+      rooms.push_back(&shards_[i].back().room());
+      rooms.back()->name(std::to_string(endpoint.port()) + "/"
+          + std::to_string(i));
+    }
+
+    std::size_t home = ports_++ % shards_.size();
+    std::vector<chat_room*> peers;
+    for (std::size_t i = 0; i < rooms.size(); ++i)
+      if (i != home)
+        peers.push_back(rooms[i]);
+    for (std::size_t i = 0; i < rooms.size(); ++i)
+      rooms[i]->link(*services_[i], *rooms[home],
+          i == home ? peers : std::vector<chat_room*>());
+    return shards_[0].back();
+  }
+
+  // Every shard's room sees every message, so shard 0's history is whole.
+  void dump_history(std::ostream& os)
+  {
+    for (auto& server: shards_[0])
+      server.dump_history(os);
   }
 
-  void deliver(const chat_message& msg)
+  // Each shard's room only holds its own sessions, so all are dumped.
+  void dump_metrics(std::ostream& os)
   {
-    recent_msgs_.push_back(msg);
-    while (recent_msgs_.size() > max_recent_msgs)
-      recent_msgs_.pop_front();
+    for (auto& shard: shards_)
+      for (auto& server: shard)
+        server.dump_metrics(os);
+  }
 
-    for (auto participant: participants_)
-      participant->deliver(msg);
+  void run()
+  {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < services_.size(); ++i)
+    {
+      asio::io_service* service = services_[i];
+      threads.emplace_back([service, i]()
+          {
+            pin_to_core(i);
+            service->run();
+          });
+    }
+    pin_to_core(0);
+    services_[0]->run();
+    for (auto& t: threads)
+      t.join();
   }
 
 private:
-  std::set<chat_participant_ptr> participants_;
-  enum { max_recent_msgs = 100 };
-  chat_message_queue recent_msgs_;
+  std::vector<asio::io_service*> services_;
+  std::vector<std::unique_ptr<asio::io_service>> owned_services_;
+  std::vector<std::list<chat_server>> shards_;
+  std::size_t ports_;
 };
 
 //----------------------------------------------------------------------
 
-class chat_session
-  : public chat_participant,
-    public std::enable_shared_from_this<chat_session>
+#if defined(__linux__)
+
+// A peer on this machine, reached through a shm_channel instead of a socket.
+// The frames are the same as on TCP. The link thread sees that the peer has
+// written and hands the read over to the strand with read_ready(), which
+// returns once the strand has taken everything the ring had.
+class shm_session
+  : public strand_session
 {
 public:
-  chat_session(tcp::socket socket, chat_room& room)
-    : socket_(std::move(socket)),
-      room_(room)
+  shm_session(asio::io_service& io_service, shm_channel& channel,
+      std::int32_t peer, chat_room& room, const queue_limits& limits)
+    : strand_session(io_service, room, limits),
+      channel_(channel),
+      retry_timer_(io_service),
+      pending_index_(0),
+      pending_offset_(0),
+      pending_bytes_(0),
+      body_have_(0),
+      reading_body_(false),
+      closing_(false),
+      handoff_done_(false)
   {
+    pending_.reserve(max_write_batch);
+    peer_name("shm:" + std::to_string(peer));
   }
 
-  void start()
+  // Link thread. Returns once the strand has drained the ring, or at once
+  // if stopping is set while it waits.
+  void read_ready(const std::atomic<bool>& stopping)
   {
-    room_.join(shared_from_this());
-    do_read_header();
+    handoff(stopping, [this]() { read_ring(); });
   }
 
-  void deliver(const chat_message& msg)
+  // Link thread. The peer has gone: leave the room and touch the rings no
+  // more, so that the link can clear them for the next peer.
+  void close(const std::atomic<bool>& stopping)
   {
-    bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(msg);
-    if (!write_in_progress)
-    {
-      do_write();
-    }
+    handoff(stopping,
+        [this]()
+        {
+          closing_ = true;
+          retry_timer_.cancel();
+          leave(peer_gone);
+        });
   }
 
 private:
-  void do_read_header()
+  enum { ring_full_retry_ms = 1 };
+
+  template <typename Function>
+  void handoff(const std::atomic<bool>& stopping, Function f)
   {
     auto self(shared_from_this());
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this, self](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec && read_msg_.decode_header())
+    handoff_done_ = false;
+    strand_.post(make_custom_alloc_handler(handoff_allocator_,
+          [this, self, f]()
           {
-            do_read_body();
-          }
-          else
-          {
-            room_.leave(shared_from_this());
-          }
-        });
+            f();
+            std::lock_guard<std::mutex> lock(handoff_mutex_);
+            handoff_done_ = true;
+            handoff_cv_.notify_one();
+          }));
+    std::unique_lock<std::mutex> lock(handoff_mutex_);
+    while (!handoff_done_ && !stopping)
+      handoff_cv_.wait_for(lock, std::chrono::milliseconds(100));
   }
 
-  void do_read_body()
+  // Nothing to start: the link thread says when there is data.
+  void do_read()
   {
-    auto self(shared_from_this());
-    asio::async_read(socket_,
-        asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this, self](std::error_code ec, std::size_t /*length*/)
+  }
+
+  // Takes frames out of the ring until it is empty. Once the session is
+  // closing, whatever the peer still sends is thrown away.
+  void read_ring()
+  {
+    shm_ring& ring = channel_.to_relay();
+    std::size_t frames = 0;
+    std::size_t bytes = 0;
+    for (;;)
+    {
+      if (closing_)
+      {
+        char* p = read_buffer_.prepare();
+        if (ring.read(p, read_buffer_.space()) == 0)
+          break;
+        continue;
+      }
+
+      if (reading_body_)
+      {
+        std::size_t n = ring.read(read_msg_.body() + body_have_,
+            read_msg_.body_length() - body_have_);
+        bytes += n;
+        body_have_ += n;
+        if (body_have_ < read_msg_.body_length())
+          break;
+        reading_body_ = false;
+        handle_message();
+        ++frames;
+        continue;
+      }
+
+      char* p = read_buffer_.prepare();
+      std::size_t n = ring.read(p, read_buffer_.space());
+      if (n == 0)
+        break;
+      bytes += n;
+      read_buffer_.commit(n);
+      if (!handle_frames(frames) && !reading_body_)
+        closing_ = true;
+    }
+    if (frames != 0)
+      record_read(frames, bytes);
+  }
+
+  void read_body(std::size_t have)
+  {
+    body_have_ = have;
+    reading_body_ = true;
+  }
+
+  void start_write()
+  {
+    pending_.clear();
+    take_batch([this](const pooled_message& msg)
         {
-          if (!ec)
-          {
-            room_.deliver(read_msg_);
-            do_read_header();
-          }
-          else
-          {
-            room_.leave(shared_from_this());
-          }
+          pending_.push_back(&msg);
         });
+    pending_index_ = 0;
+    pending_offset_ = 0;
+    pending_bytes_ = 0;
+    write_pending();
   }
 
-  void do_write()
+  // Copies as much of the batch as the ring takes, waking the peer once.
+  // A full ring is tried again shortly; the peer may be slow or gone, and
+  // if it is gone the link closes the session.
+  void write_pending()
   {
-    auto self(shared_from_this());
-    asio::async_write(socket_,
-        asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this, self](std::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
-          {
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty())
+    if (closing_)
+      return;
+
+    shm_ring& ring = channel_.to_peer();
+    while (pending_index_ < pending_.size())
+    {
+      const pooled_message& msg = *pending_[pending_index_];
+      pending_offset_ += ring.write(msg.data() + pending_offset_,
+          msg.length() - pending_offset_);
+      if (pending_offset_ < msg.length())
+        break;
+      pending_bytes_ += msg.length();
+      pending_offset_ = 0;
+      ++pending_index_;
+    }
+    ring.notify();
+
+    if (pending_index_ < pending_.size())
+    {
+      auto self(shared_from_this());
+      retry_timer_.expires_from_now(
+          std::chrono::milliseconds(ring_full_retry_ms));
+      retry_timer_.async_wait(strand_.wrap(
+            [this, self](std::error_code ec)
             {
-              do_write();
-            }
-          }
-          else
-          {
-            room_.leave(shared_from_this());
-          }
-        });
+              if (!ec)
+                write_pending();
+            }));
+      return;
+    }
+
+    record_write(pending_.size(), pending_bytes_);
+    if (batch_written())
+      start_write();
   }
 
-  tcp::socket socket_;
+  shm_channel& channel_;
+  asio::steady_timer retry_timer_;
+  std::vector<const pooled_message*> pending_;
+  std::size_t pending_index_;
+  std::size_t pending_offset_;
+  std::size_t pending_bytes_;
+  std::size_t body_have_;
+  bool reading_body_;
+  bool closing_;
+  std::mutex handoff_mutex_;
+  std::condition_variable handoff_cv_;
+  bool handoff_done_;
+  handler_allocator handoff_allocator_;
+};
+
+// Owns the shared-memory segment for one port and a thread that sleeps on
+// it. The thread starts a session when a peer claims the segment, hands
+// reads to it, and closes it when the peer lets go or its process dies.
+class shm_link
+{
+public:
+  shm_link(asio::io_service& io_service, unsigned short port,
+      chat_room& room, const queue_limits& limits)
+    : io_service_(io_service),
+      channel_(shm_channel::create(shm_channel::name_for_port(port))),
+      room_(room),
+      limits_(limits),
+      stopping_(false),
+      thread_([this](){ run(); })
+  {
+  }
+
+  ~shm_link()
+  {
+    stopping_ = true;
+    channel_->to_relay().interrupt();
+    thread_.join();
+  }
+
+private:
+  enum { liveness_check_ms = 100 };
+
+  void run()
+  {
+    std::shared_ptr<shm_session> session;
+    while (!stopping_)
+    {
+      std::int32_t peer = channel_->peer();
+      if (session && (peer <= 0 || !shm_channel::alive(peer)))
+      {
+        session->close(stopping_);
+        session.reset();
+        channel_->release_peer();
+      }
+      else if (!session && peer < 0)
+      {
+        channel_->release_peer();
+      }
+      else if (!session && peer > 0)
+      {
+        if (shm_channel::alive(peer))
+        {
+          session = std::make_shared<shm_session>(io_service_, *channel_,
+              peer, room_, limits_);
+          session->start();
+        }
+        else
+        {
+          channel_->release_peer();
+        }
+      }
+
+      if (session && !channel_->to_relay().empty())
+        session->read_ready(stopping_);
+      else
+        channel_->to_relay().wait(liveness_check_ms);
+    }
+    if (session)
+      session->close(stopping_);
+  }
+
+  asio::io_service& io_service_;
+  std::unique_ptr<shm_channel> channel_;
   chat_room& room_;
-  chat_message read_msg_;
-  chat_message_queue write_msgs_;
+  const queue_limits& limits_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
 };
 
+#endif // defined(__linux__)
+
 //----------------------------------------------------------------------
 
-class chat_server
+#if defined(__linux__)
+
+// Registered read buffers. A session's read_buffer_ takes a slot in a
+// sparse table for as long as the session lives. When the table is full,
+// or the kernel cannot register sparse tables, sessions fall back to recv.
+class uring_buffer_table
 {
 public:
-  chat_server(asio::io_service& io_service,
-      const tcp::endpoint& endpoint)
-    : acceptor_(io_service, endpoint),
-      socket_(io_service)
+  enum { table_size = 1024 };
+
+  explicit uring_buffer_table(uring& ring)
+    : ring_(ring)
   {
-    do_accept();
+    if (ring_.register_sparse_buffers(table_size))
+      for (unsigned i = table_size; i > 0; --i)
+        free_.push_back(i - 1);
+  }
+
+  // Returns the slot now holding the buffer, or -1.
+  int acquire(char* base, std::size_t length)
+  {
+    if (free_.empty() || !ring_.update_buffer(free_.back(), base, length))
+      return -1;
+    int index = free_.back();
+    free_.pop_back();
+    return index;
+  }
+
+  void release(int index)
+  {
+    if (index < 0)
+      return;
+    ring_.update_buffer(index, 0, 0);
+    free_.push_back(index);
   }
 
 private:
-  void do_accept()
+  uring& ring_;
+  std::vector<unsigned> free_;
+};
+
+// The io_uring transport. The loop, the rooms and every session share one
+// thread, so deliver() queues directly and completions need no strand.
+// An operation's user_data is the session's address with the operation in
+// the low bits. The session keeps itself alive through self_ until it is
+// closed and nothing it submitted is still in the kernel.
+class uring_session
+  : public relay_session
+{
+public:
+  enum operation { read_op = 1, body_op = 2, write_op = 3 };
+  typedef timer_wheel<uring_session> wheel;
+
+  uring_session(uring& ring, uring_buffer_table& buffers, int fd,
+      chat_room& room, const queue_limits& limits)
+    : relay_session(room, limits),
+      ring_(ring),
+      buffers_(buffers),
+      fd_(fd),
+      slot_(-1),
+      pending_(0),
+      body_have_(0),
+      reading_body_(false),
+      closing_(false),
+      send_(max_write_batch),
+      wheel_(0)
   {
-    acceptor_.async_accept(socket_,
-        [this](std::error_code ec)
+    if (limits.send_buffer != 0)
+    {
+      int size = static_cast<int>(limits.send_buffer);
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    tcp::endpoint peer;
+    socklen_t length = peer.capacity();
+    if (::getpeername(fd, peer.data(), &length) == 0)
+    {
+      peer.resize(length);
+      peer_name(peer);
+    }
+  }
+
+  void start()
+  {
+    self_ = shared_from_this();
+    slot_ = buffers_.acquire(read_buffer_.prepare(), read_buffer_.capacity());
+    room_.join(self_);
+    do_read();
+  }
+
+  void deliver(const relay_message_ptr& msg)
+  {
+    queue(msg);
+  }
+
+  // Starts the idle checks. Called once, after start().
+  void watch(wheel& w, std::chrono::milliseconds interval)
+  {
+    wheel_ = &w;
+    interval_ = interval;
+    w.schedule(self(), interval_);
+  }
+
+  // Called from the loop when the server advances its wheel.
+  void timer_expired()
+  {
+    if (closing_)
+      return;
+    if (check_idle())
+      wheel_->schedule(self(), interval_);
+    else
+      close(idle_timeout);
+  }
+
+  void complete(operation op, int result)
+  {
+    --pending_;
+    if (closing_)
+    {
+      finish();
+      return;
+    }
+    if (op == write_op)
+      write_done(result);
+    else if (op == body_op)
+      body_done(result);
+    else
+      read_done(result);
+  }
+
+private:
+  std::shared_ptr<uring_session> self()
+  {
+    return std::static_pointer_cast<uring_session>(shared_from_this());
+  }
+
+  std::uint64_t user_data(operation op)
+  {
+    return reinterpret_cast<std::uintptr_t>(this) | op;
+  }
+
+  void do_read()
+  {
+    if (slot_ >= 0)
+      ring_.prep_read_fixed(fd_, read_buffer_.prepare(), read_buffer_.space(),
+          slot_, user_data(read_op));
+    else
+      ring_.prep_recv(fd_, read_buffer_.prepare(), read_buffer_.space(),
+          user_data(read_op));
+    ++pending_;
+  }
+
+  void read_done(int result)
+  {
+    if (result <= 0)
+    {
+      close(result == 0 ? peer_closed : read_error);
+      return;
+    }
+    read_buffer_.commit(result);
+    std::size_t frames = 0;
+    bool more = handle_frames(frames);
+    record_read(frames, result);
+    if (more)
+      do_read();
+    else if (!reading_body_)
+      close(bad_frame);
+  }
+
+  void read_body(std::size_t have)
+  {
+    reading_body_ = true;
+    body_have_ = have;
+    ring_.prep_recv(fd_, read_msg_.body() + have,
+        read_msg_.body_length() - have, user_data(body_op));
+    ++pending_;
+  }
+
+  void body_done(int result)
+  {
+    if (result <= 0)
+    {
+      close(result == 0 ? peer_closed : read_error);
+      return;
+    }
+    body_have_ += result;
+    if (body_have_ < read_msg_.body_length())
+    {
+      read_body(body_have_);
+      return;
+    }
+    reading_body_ = false;
+    handle_message();
+    do_read();
+  }
+
+  void start_write()
+  {
+    if (closing_)
+      return;
+    send_.clear();
+    take_batch([this](const pooled_message& msg)
         {
-          if (!ec)
+          send_.push_back(msg.data(), msg.length());
+        });
+    send_.start(ring_, fd_, user_data(write_op));
+    ++pending_;
+  }
+
+  void write_done(int result)
+  {
+    // A batch is never empty, so sending nothing means the peer is gone.
+    if (result <= 0)
+    {
+      close(result == 0 ? peer_closed : write_error);
+      return;
+    }
+    if (!send_.sent(ring_, fd_, user_data(write_op), result))
+    {
+      ++pending_;
+      return;
+    }
+    record_write(send_.size(), send_.bytes());
+    if (batch_written())
+      start_write();
+  }
+
+  // Leaves the room and shuts the socket down, which completes whatever is
+  // still pending.
+  void close(disconnect_reason reason)
+  {
+    if (closing_)
+      return;
+    closing_ = true;
+    leave(reason);
+    ::shutdown(fd_, SHUT_RDWR);
+    finish();
+  }
+
+  void finish()
+  {
+    if (pending_ != 0)
+      return;
+    buffers_.release(slot_);
+    ::close(fd_);
+    self_.reset();
+  }
+
+  uring& ring_;
+  uring_buffer_table& buffers_;
+  int fd_;
+  int slot_;
+  unsigned pending_;
+  std::size_t body_have_;
+  bool reading_body_;
+  bool closing_;
+  uring_send send_;
+  std::shared_ptr<relay_session> self_;
+  wheel* wheel_;
+  std::chrono::milliseconds interval_;
+};
+
+// Accepts on every port and runs all sessions from a single loop. Each
+// pass hands the kernel everything the previous completions queued up in
+// one io_uring_enter call. With an idle timeout, a timeout on the ring
+// advances the sessions' timer wheel every idle tick.
+class uring_server
+{
+public:
+  enum { ring_entries = 4096 };
+  enum { accept_op = 4, stats_op = 5, accept_retry_op = 6, idle_op = 7 };
+  enum { accept_retry_ms = 100 };
+  enum { idle_tick_ms = 100 };
+
+  uring_server(const queue_limits& limits, int stats_interval)
+    : ring_(ring_entries),
+      buffers_(ring_),
+      limits_(limits),
+      stats_interval_(stats_interval),
+      wheel_(std::chrono::milliseconds(idle_tick_ms))
+  {
+  }
+
+  void listen(asio::io_service& io_service, const tcp::endpoint& endpoint,
+      std::size_t history_size)
+  {
+    listeners_.emplace_back(io_service, endpoint, history_size);
+    listener& l = listeners_.back();
+    ring_.prep_accept(l.acceptor.native_handle(),
+        reinterpret_cast<std::uintptr_t>(&l) | accept_op);
+  }
+
+  void run()
+  {
+    if (stats_interval_ > 0)
+      start_stats_timer();
+    if (limits_.idle_timeout.count() != 0)
+      start_idle_timer();
+    for (;;)
+    {
+      ring_.submit_and_wait(1);
+      ring_.complete([this](std::uint64_t user_data, int result)
           {
-            std::make_shared<chat_session>(std::move(socket_), room_)->start();
-          }
+            dispatch(user_data, result);
+          });
+    }
+  }
 
-          do_accept();
-        });
+private:
+  struct listener
+  {
+    listener(asio::io_service& io_service, const tcp::endpoint& endpoint,
+        std::size_t history_size)
+      : acceptor(io_service, endpoint),
+        room(history_size, std::to_string(endpoint.port()))
+    {
+    }
+
+    tcp::acceptor acceptor;
+    chat_room room;
+    __kernel_timespec retry;
+  };
+
+  void dispatch(std::uint64_t user_data, int result)
+  {
+    unsigned op = user_data & 7;
+    void* target = reinterpret_cast<void*>(user_data & ~std::uint64_t(7));
+    if (op == accept_op)
+    {
+      listener& l = *static_cast<listener*>(target);
+      if (result >= 0)
+      {
+        auto session = std::make_shared<uring_session>(ring_, buffers_,
+            result, l.room, limits_);
+        session->start();
+        if (limits_.idle_timeout.count() != 0)
+          session->watch(wheel_, limits_.heartbeat_interval);
+      }
+      else if (result != -EINTR && result != -EAGAIN
+          && result != -ECONNABORTED)
+      {
+        // Out of descriptors, say. Accepting again at once would fail at
+        // once, so wait a little first.
+        std::cerr << "accept: " << std::strerror(-result) << ", retrying in "
+          << accept_retry_ms << " ms\n";
+        l.retry.tv_sec = 0;
+        l.retry.tv_nsec = accept_retry_ms * 1000000L;
+        ring_.prep_timeout(&l.retry,
+            reinterpret_cast<std::uintptr_t>(&l) | accept_retry_op);
+        return;
+      }
+      ring_.prep_accept(l.acceptor.native_handle(),
+          reinterpret_cast<std::uintptr_t>(&l) | accept_op);
+    }
+    else if (op == accept_retry_op)
+    {
+      listener& l = *static_cast<listener*>(target);
+      ring_.prep_accept(l.acceptor.native_handle(),
+          reinterpret_cast<std::uintptr_t>(&l) | accept_op);
+    }
+    else if (op == stats_op)
+    {
+      relay_metrics::dump_scope scope;
+      relay_metrics::instance().dump(std::cerr);
+      for (auto& l: listeners_)
+      {
+        l.room.dump_metrics(std::cerr);
+        l.room.dump_history(std::cerr);
+      }
+      start_stats_timer();
+    }
+    else if (op == idle_op)
+    {
+      wheel_.advance();
+      start_idle_timer();
+    }
+    else
+    {
+      static_cast<uring_session*>(target)->complete(
+          static_cast<uring_session::operation>(op), result);
+    }
   }
 
-  tcp::acceptor acceptor_;
-  tcp::socket socket_;
-  chat_room room_;
+  void start_stats_timer()
+  {
+    stats_timeout_.tv_sec = stats_interval_;
+    stats_timeout_.tv_nsec = 0;
+    ring_.prep_timeout(&stats_timeout_, stats_op);
+  }
+
+  void start_idle_timer()
+  {
+    idle_tick_.tv_sec = 0;
+    idle_tick_.tv_nsec = idle_tick_ms * 1000000L;
+    ring_.prep_timeout(&idle_tick_, idle_op);
+  }
+
+  uring ring_;
+  uring_buffer_table buffers_;
+  const queue_limits& limits_;
+  int stats_interval_;
+  __kernel_timespec stats_timeout_;
+  uring_session::wheel wheel_;
+  __kernel_timespec idle_tick_;
+  std::list<listener> listeners_;
 };
 
+#endif // defined(__linux__)
+
 //----------------------------------------------------------------------
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 2)
+    std::size_t thread_count = std::thread::hardware_concurrency();
+    std::size_t shard_count = 1;
+    int stats_interval = 0;
+    int metrics_port = 0;
+    queue_limits limits;
+    std::size_t history_size = 0;
+    bool use_uring = false;
+    bool udp_steering = false;
+    bool use_shm = false;
+    int first_port = 1;
+    while (first_port + 1 < argc && argv[first_port][0] == '-')
+    {
+      if (std::strcmp(argv[first_port], "--io-uring") == 0)
+      {
+        use_uring = true;
+        ++first_port;
+        continue;
+      }
+      if (std::strcmp(argv[first_port], "--udp-steering") == 0)
+      {
+        udp_steering = true;
+        ++first_port;
+        continue;
+      }
+      if (std::strcmp(argv[first_port], "--shm") == 0)
+      {
+        use_shm = true;
+        ++first_port;
+        continue;
+      }
+      if (std::strcmp(argv[first_port], "--max-body") == 0)
+        pooled_message::max_body_length(std::atoi(argv[first_port + 1]));
+      else if (std::strcmp(argv[first_port], "--threads") == 0)
+        thread_count = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--shards") == 0)
+        shard_count = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--stats") == 0)
+        stats_interval = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--metrics-port") == 0)
+        metrics_port = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--steering-queue") == 0)
+        limits.steering = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--bulk-queue") == 0)
+        limits.bulk = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--send-buffer") == 0)
+        limits.send_buffer = std::atoi(argv[first_port + 1]);
+      else if (std::strcmp(argv[first_port], "--coalesce") == 0)
+        limits.coalesce_window = std::chrono::milliseconds(
+            std::atoi(argv[first_port + 1]));
+      else if (std::strcmp(argv[first_port], "--heartbeat") == 0)
+        limits.heartbeat_interval = std::chrono::milliseconds(
+            std::atoi(argv[first_port + 1]));
+      else if (std::strcmp(argv[first_port], "--idle-timeout") == 0)
+        limits.idle_timeout = std::chrono::milliseconds(
+            std::atoi(argv[first_port + 1]));
+      else if (std::strcmp(argv[first_port], "--history") == 0)
+        history_size = std::atoi(argv[first_port + 1]);
+      else
+        break;
+      first_port += 2;
+    }
+
+    if (argc <= first_port || argv[first_port][0] == '-')
     {
-      std::cerr << "Usage: chat_server <port> [<port> ...]\n";
+      std::cerr << "Usage: chat_server [--io-uring] [--udp-steering] [--shm]"
+        " [--max-body <bytes>] [--threads <n>] [--shards <n>]"
+        " [--stats <seconds>] [--metrics-port <port>]"
+        " [--steering-queue <n>] [--bulk-queue <n>] [--send-buffer <bytes>]"
+        " [--coalesce <ms>] [--heartbeat <ms>] [--idle-timeout <ms>]"
+        " [--history <n>] <port> [<port> ...]\n";
       return 1;
     }
 
+    if (thread_count == 0)
+      thread_count = 1;
+    // --shards 0 means one per core.
+    if (shard_count == 0)
+      shard_count = std::thread::hardware_concurrency();
+
     asio::io_service io_service;
 
+    // The io_uring loop is single-threaded and ignores --threads, --shards,
+    // --udp-steering, --shm and --metrics-port; --stats still dumps the
+    // room and session metrics.
+#if defined(__linux__)
+    if (use_uring && uring::available())
+    {
+      uring_server server(limits, stats_interval);
+      for (int i = first_port; i < argc; ++i)
+      {
+        tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
+        server.listen(io_service, endpoint, history_size);
+      }
+      server.run();
+      return 0;
+    }
+#endif
+    if (use_uring)
+      std::cerr << "io_uring is not available, using the asio reactor\n";
+
+    // Sharded, each shard runs on one thread and --threads is ignored.
     std::list<chat_server> servers;
-    for (int i = 1; i < argc; ++i)
+    std::unique_ptr<sharded_server> sharded;
+    if (shard_count > 1)
+      sharded.reset(new sharded_server(io_service, shard_count));
+#if defined(__linux__)
+    std::list<shm_link> shm_links;
+#endif
+    for (int i = first_port; i < argc; ++i)
     {
       tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_service, endpoint);
+      chat_server* server;
+      if (sharded)
+      {
+        server = &sharded->listen(endpoint, limits, history_size,
+            udp_steering);
+      }
+      else
+      {
+        servers.emplace_back(io_service, endpoint, limits, history_size,
+            udp_steering);
+        server = &servers.back();
+      }
+
+      // A co-located peer may take the port's shared-memory channel instead
+      // of connecting. Its session runs on shard 0.
+#if defined(__linux__)
+      if (use_shm)
+        shm_links.emplace_back(io_service, endpoint.port(), server->room(),
+            limits);
+#else
+      (void)server;
+#endif
+    }
+
+    std::function<void(std::ostream&)> dump_metrics =
+      [&](std::ostream& os)
+      {
+        relay_metrics::instance().dump(os);
+        for (auto& server: servers)
+          server.dump_metrics(os);
+        if (sharded)
+          sharded->dump_metrics(os);
+      };
+    std::unique_ptr<metrics_endpoint> metrics;
+    if (metrics_port > 0)
+      metrics.reset(new metrics_endpoint(io_service, metrics_port,
+            dump_metrics));
+
+    asio::steady_timer stats_timer(io_service);
+    std::function<void()> dump_stats = [&]()
+    {
+      stats_timer.expires_from_now(std::chrono::seconds(stats_interval));
+      stats_timer.async_wait(
+          [&](std::error_code ec)
+          {
+            if (ec)
+              return;
+            relay_metrics::dump_scope scope;
+            dump_metrics(std::cerr);
+            for (auto& server: servers)
+              server.dump_history(std::cerr);
+            if (sharded)
+              sharded->dump_history(std::cerr);
+            dump_stats();
+          });
+    };
+    if (stats_interval > 0)
+      dump_stats();
+
+    if (sharded)
+    {
+      sharded->run();
+      return 0;
     }
 
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < thread_count; ++i)
+      threads.emplace_back([&io_service](){ io_service.run(); });
     io_service.run();
+    for (auto& t: threads)
+      t.join();
   }
   catch (std::exception& e)
   {
@@ -0,0 +1,125 @@
+//
+// handler_allocator.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Keeps asio's per-operation memory off the heap.
+//
+
+#ifndef HANDLER_ALLOCATOR_HPP
+#define HANDLER_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "asio.hpp"
+
+// Storage for one outstanding asio operation at a time. asio frees an
+// operation's memory before it calls the handler, so a chain of reads, or
+// of writes, keeps reusing the same block. Anything that does not fit, or
+// arrives while the block is taken, falls back to the heap.
+class handler_allocator
+{
+public:
+  handler_allocator()
+    : in_use_(false)
+  {
+  }
+
+  void* allocate(std::size_t size)
+  {
+    if (!in_use_ && size <= sizeof(storage_))
+    {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void deallocate(void* pointer)
+  {
+    if (pointer == &storage_)
+      in_use_ = false;
+    else
+      ::operator delete(pointer);
+  }
+
+private:
+  handler_allocator(const handler_allocator&);
+  handler_allocator& operator=(const handler_allocator&);
+
+  typename std::aligned_storage<1024>::type storage_;
+  bool in_use_;
+};
+
+// Wraps a handler so that asio's allocation hooks find handler_allocator.
+template <typename Handler>
+class custom_alloc_handler
+{
+public:
+  custom_alloc_handler(handler_allocator& a, Handler h)
+    : allocator_(a),
+      handler_(std::move(h))
+  {
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args)
+  {
+    handler_(std::forward<Args>(args)...);
+  }
+
+  friend void* asio_handler_allocate(std::size_t size,
+      custom_alloc_handler<Handler>* this_handler)
+  {
+    return this_handler->allocator_.allocate(size);
+  }
+
+  friend void asio_handler_deallocate(void* pointer, std::size_t /*size*/,
+      custom_alloc_handler<Handler>* this_handler)
+  {
+    this_handler->allocator_.deallocate(pointer);
+  }
+
+private:
+  handler_allocator& allocator_;
+  Handler handler_;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(
+    handler_allocator& a, Handler h)
+{
+  return custom_alloc_handler<Handler>(a, std::move(h));
+}
+
+// A buffer sequence that refers to a vector instead of copying it, so that
+// a gathered async_write does not allocate a copy of its buffer list. The
+// vector must not change until the write completes.
+class const_buffers_ref
+{
+public:
+  typedef asio::const_buffer value_type;
+  typedef std::vector<asio::const_buffer>::const_iterator const_iterator;
+
+  explicit const_buffers_ref(const std::vector<asio::const_buffer>& buffers)
+    : buffers_(&buffers)
+  {
+  }
+
+  const_iterator begin() const
+  {
+    return buffers_->begin();
+  }
+
+  const_iterator end() const
+  {
+    return buffers_->end();
+  }
+
+private:
+  const std::vector<asio::const_buffer>* buffers_;
+};
+
+#endif // HANDLER_ALLOCATOR_HPP
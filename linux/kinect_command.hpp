@@ -0,0 +1,301 @@
+//
+// kinect_command.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Commands exchanged between the Kinect host and the robot.
+//
+
+#ifndef KINECT_COMMAND_HPP
+#define KINECT_COMMAND_HPP
+
+#include <cstdint>
+#include <cstring>
+#include "chat_message.hpp"
+
+// On a protocol v2 connection a command is a command_type frame whose body
+// is:
+//
+//   offset 0  uint8    opcode
+//   offset 1  uint8    flags
+//   offset 2  float32  linear velocity, little-endian (with has_twist only)
+//   offset 6  float32  angular velocity, little-endian (with has_twist only)
+//
+// followed, with has_deadline only, by
+//
+//   uint32   issue time, ms on the sender's steady clock, little-endian
+//   uint16   time to live in ms, little-endian
+//
+// The issue time only means something next to other issue times from the
+// same sender, since the two hosts' clocks are not synchronised. Commands
+// older than their time to live are not acted on.
+//
+// On a v1 connection the same command is the legacy text, e.g.
+// "[kinect] left" or "[kabuki] kinect message received" for ack.
+// Neither encoding nor decoding allocates.
+class kinect_command
+{
+public:
+  enum opcode
+  {
+    none = 0,
+    forward = 1,
+    left = 2,
+    right = 3,
+    stop = 4,
+    button = 5,
+    ack = 6
+  };
+
+  enum { has_twist = 0x01, has_deadline = 0x02 };
+  enum { twist_length = 10 };
+  enum { max_length = 16 };
+  enum { max_legacy_length = 40 };
+
+  kinect_command(opcode op = none)
+    : op_(op),
+      flags_(0),
+      linear_(0),
+      angular_(0),
+      issued_(0),
+      ttl_(0)
+  {
+  }
+
+  kinect_command(opcode op, float linear, float angular)
+    : op_(op),
+      flags_(has_twist),
+      linear_(linear),
+      angular_(angular),
+      issued_(0),
+      ttl_(0)
+  {
+  }
+
+  opcode op() const
+  {
+    return static_cast<opcode>(op_);
+  }
+
+  bool twist() const
+  {
+    return (flags_ & has_twist) != 0;
+  }
+
+  float linear() const
+  {
+    return linear_;
+  }
+
+  float angular() const
+  {
+    return angular_;
+  }
+
+  bool stamped() const
+  {
+    return (flags_ & has_deadline) != 0;
+  }
+
+  std::uint32_t issued() const
+  {
+    return issued_;
+  }
+
+  std::uint16_t ttl() const
+  {
+    return ttl_;
+  }
+
+  // Marks the command as issued at issued ms on the sender's clock, to be
+  // acted on for ttl ms from then.
+  void stamp(std::uint32_t issued, std::uint16_t ttl)
+  {
+    flags_ |= has_deadline;
+    issued_ = issued;
+    ttl_ = ttl;
+  }
+
+  // Forward, left and right. Only the newest one matters, so they may go
+  // as datagrams to a relay that offers udp_steering.
+  static bool steering(opcode op)
+  {
+    return op == forward || op == left || op == right;
+  }
+
+  // Where the relay routes this command.
+  chat_header::topic topic() const
+  {
+    return op() == ack ? chat_header::ack_topic : chat_header::command_topic;
+  }
+
+  static const char* name(opcode op)
+  {
+    switch (op)
+    {
+    case forward: return "forward";
+    case left: return "left";
+    case right: return "right";
+    case stop: return "stop";
+    case button: return "button";
+    case ack: return "ack";
+    default: return "none";
+    }
+  }
+
+  std::size_t encode(char* body) const
+  {
+    body[0] = static_cast<char>(op_);
+    body[1] = static_cast<char>(flags_);
+    std::size_t n = 2;
+    if (twist())
+    {
+      chat_store_le32(body + 2, float_bits(linear_));
+      chat_store_le32(body + 6, float_bits(angular_));
+      n = twist_length;
+    }
+    if (stamped())
+    {
+      chat_store_le32(body + n, issued_);
+      body[n + 4] = static_cast<char>(ttl_ & 0xff);
+      body[n + 5] = static_cast<char>(ttl_ >> 8);
+      n += 6;
+    }
+    return n;
+  }
+
+  bool decode(const char* body, std::size_t length)
+  {
+    if (length < 2 || static_cast<std::uint8_t>(body[0]) > ack)
+      return false;
+    op_ = static_cast<std::uint8_t>(body[0]);
+    flags_ = static_cast<std::uint8_t>(body[1]);
+    linear_ = angular_ = 0;
+    issued_ = ttl_ = 0;
+    std::size_t n = 2;
+    if (twist())
+    {
+      if (length < twist_length)
+        return false;
+      linear_ = bits_float(chat_load_le32(body + 2));
+      angular_ = bits_float(chat_load_le32(body + 6));
+      n = twist_length;
+    }
+    if (stamped())
+    {
+      if (length < n + 6)
+        return false;
+      issued_ = chat_load_le32(body + n);
+      ttl_ = static_cast<std::uint16_t>(static_cast<std::uint8_t>(body[n + 4])
+          | static_cast<std::uint8_t>(body[n + 5]) << 8);
+    }
+    return true;
+  }
+
+  std::size_t encode_legacy(char* body) const
+  {
+    const char* text = op() == ack ? legacy_ack() : name(op());
+    std::size_t n = 0;
+    if (op() != ack)
+    {
+      std::memcpy(body, legacy_prefix(), std::strlen(legacy_prefix()));
+      n = std::strlen(legacy_prefix());
+    }
+    std::memcpy(body + n, text, std::strlen(text));
+    return n + std::strlen(text);
+  }
+
+  // Accepts what the old endpoints sent: "[kinect] " followed by a command
+  // name (anything after the name is ignored), or any "[kabuki]" text.
+  bool decode_legacy(const char* body, std::size_t length)
+  {
+    flags_ = 0;
+    linear_ = angular_ = 0;
+    issued_ = ttl_ = 0;
+    if (starts_with(body, length, "[kabuki]"))
+    {
+      op_ = ack;
+      return true;
+    }
+    std::size_t n = std::strlen(legacy_prefix());
+    if (!starts_with(body, length, legacy_prefix()))
+      return false;
+    for (int op = forward; op <= button; ++op)
+    {
+      if (starts_with(body + n, length - n, name(static_cast<opcode>(op))))
+      {
+        op_ = static_cast<std::uint8_t>(op);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Fills msg in the representation its header format calls for. The
+  // header is left for the caller to encode.
+  template <typename Message>
+  void encode(Message& msg) const
+  {
+    char body[max_legacy_length];
+    std::size_t n;
+    if (msg.format() == chat_header::binary_header)
+    {
+      msg.type(chat_header::command_type);
+      n = encode(body);
+    }
+    else
+    {
+      msg.type(chat_header::data_type);
+      n = encode_legacy(body);
+    }
+    msg.body_length(n);
+    std::memcpy(msg.body(), body, n);
+  }
+
+  template <typename Message>
+  bool decode(const Message& msg)
+  {
+    if (msg.type() == chat_header::command_type)
+      return decode(msg.body(), msg.body_length());
+    return decode_legacy(msg.body(), msg.body_length());
+  }
+
+private:
+  static const char* legacy_prefix()
+  {
+    return "[kinect] ";
+  }
+
+  static const char* legacy_ack()
+  {
+    return "[kabuki] kinect message received";
+  }
+
+  static bool starts_with(const char* p, std::size_t length, const char* s)
+  {
+    std::size_t n = std::strlen(s);
+    return length >= n && std::memcmp(p, s, n) == 0;
+  }
+
+  static std::uint32_t float_bits(float f)
+  {
+    std::uint32_t v;
+    std::memcpy(&v, &f, sizeof(v));
+    return v;
+  }
+
+  static float bits_float(std::uint32_t v)
+  {
+    float f;
+    std::memcpy(&f, &v, sizeof(f));
+    return f;
+  }
+
+  std::uint8_t op_;
+  std::uint8_t flags_;
+  float linear_;
+  float angular_;
+  std::uint32_t issued_;
+  std::uint16_t ttl_;
+};
+
+#endif // KINECT_COMMAND_HPP
@@ -0,0 +1,375 @@
+//
+// pooled_message.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Variable-length messages whose storage comes from size-class pools.
+//
+
+#ifndef POOLED_MESSAGE_HPP
+#define POOLED_MESSAGE_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include "chat_message.hpp"
+
+//----------------------------------------------------------------------
+
+// Power-of-two size classes from min_block_size up. Freed blocks are kept on
+// a per-class free list, linked through the blocks themselves, and handed
+// out again before any new memory is requested. A class with no free block
+// doubles its block count with one chunk from the heap, up to
+// max_chunk_size bytes at a time. Nothing is given back until the pool is
+// destroyed, so a warm pool never touches the heap, and one that is still
+// warming up only does so a logarithmic number of times.
+class message_pool
+{
+public:
+  enum { min_block_size = 64 };
+  enum { class_count = 24 };
+  enum { max_chunk_size = 1 << 20 };
+
+  static message_pool& instance()
+  {
+    static message_pool pool;
+    return pool;
+  }
+
+  ~message_pool()
+  {
+    while (chunks_)
+    {
+      free_block* k = chunks_;
+      chunks_ = k->next;
+      delete[] reinterpret_cast<char*>(k);
+    }
+  }
+
+  // Returns a block of at least size bytes; capacity receives its real size.
+  char* allocate(std::size_t size, std::size_t& capacity)
+  {
+    std::size_t c = size_class(size);
+    capacity = class_size(c);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_[c].head)
+      grow(c);
+    free_block* b = free_[c].head;
+    free_[c].head = b->next;
+    return reinterpret_cast<char*>(b);
+  }
+
+  void deallocate(char* block, std::size_t capacity)
+  {
+    std::size_t c = size_class(capacity);
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_block* b = reinterpret_cast<free_block*>(block);
+    b->next = free_[c].head;
+    free_[c].head = b;
+  }
+
+  static std::size_t class_size(std::size_t c)
+  {
+    return static_cast<std::size_t>(min_block_size) << c;
+  }
+
+  static std::size_t size_class(std::size_t size)
+  {
+    std::size_t c = 0;
+    while (class_size(c) < size)
+      ++c;
+    return c;
+  }
+
+private:
+  message_pool()
+    : chunks_(0)
+  {
+  }
+
+  message_pool(const message_pool&);
+  message_pool& operator=(const message_pool&);
+
+  struct free_block
+  {
+    free_block* next;
+  };
+
+  struct free_list
+  {
+    free_list() : head(0), blocks(0) {}
+    free_block* head;
+    std::size_t blocks;
+  };
+
+  // Each chunk starts with min_block_size bytes that link it to the next,
+  // which keeps the blocks after it as aligned as the chunk itself.
+  void grow(std::size_t c)
+  {
+    std::size_t size = class_size(c);
+    std::size_t count = free_[c].blocks ? free_[c].blocks : 1;
+    std::size_t most = size < max_chunk_size ? max_chunk_size / size : 1;
+    if (count > most)
+      count = most;
+
+    char* chunk = new char[min_block_size + count * size];
+    free_block* k = reinterpret_cast<free_block*>(chunk);
+    k->next = chunks_;
+    chunks_ = k;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      free_block* b = reinterpret_cast<free_block*>(
+          chunk + min_block_size + i * size);
+      b->next = free_[c].head;
+      free_[c].head = b;
+    }
+    free_[c].blocks += count;
+  }
+
+  std::mutex mutex_;
+  free_list free_[class_count];
+  free_block* chunks_;
+};
+
+//----------------------------------------------------------------------
+
+// Standard allocator over message_pool, for std::allocate_shared and the
+// like on paths that must not touch the heap once the pool is warm.
+template <typename T>
+class pool_allocator
+{
+public:
+  typedef T value_type;
+
+  pool_allocator()
+  {
+  }
+
+  template <typename U>
+  pool_allocator(const pool_allocator<U>&)
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    std::size_t capacity = 0;
+    return reinterpret_cast<T*>(
+        message_pool::instance().allocate(n * sizeof(T), capacity));
+  }
+
+  void deallocate(T* p, std::size_t n)
+  {
+    message_pool::instance().deallocate(reinterpret_cast<char*>(p),
+        message_pool::class_size(message_pool::size_class(n * sizeof(T))));
+  }
+
+  template <typename U>
+  bool operator==(const pool_allocator<U>&) const
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const pool_allocator<U>&) const
+  {
+    return false;
+  }
+};
+
+//----------------------------------------------------------------------
+
+// Same wire format as chat_message, but the header and body live in one pool
+// block sized to the payload. The largest accepted body is set once per
+// process with max_body_length(std::size_t). Moves are cheap; copies go
+// through clone() so they are always explicit.
+class pooled_message : public chat_header
+{
+public:
+  static std::size_t max_body_length()
+  {
+    return max_body_length_ref();
+  }
+
+  static void max_body_length(std::size_t n)
+  {
+    std::size_t limit = message_pool::class_size(message_pool::class_count - 1)
+      - max_header_length;
+    max_body_length_ref() = n < limit ? n : limit;
+  }
+
+  explicit pooled_message(header_format format = ascii_header)
+    : chat_header(format),
+      block_(0),
+      capacity_(0)
+  {
+  }
+
+  // Copies a fixed-size message.
+  explicit pooled_message(const chat_message& msg)
+    : chat_header(msg),
+      block_(0),
+      capacity_(0)
+  {
+    reserve(msg.body_length());
+    std::memcpy(data(), msg.data(), msg.length());
+  }
+
+  pooled_message(pooled_message&& other)
+    : chat_header(other),
+      block_(other.block_),
+      capacity_(other.capacity_)
+  {
+    other.block_ = 0;
+    other.capacity_ = 0;
+  }
+
+  pooled_message& operator=(pooled_message&& other)
+  {
+    if (this != &other)
+    {
+      release();
+      chat_header::operator=(other);
+      block_ = other.block_;
+      capacity_ = other.capacity_;
+      other.block_ = 0;
+      other.capacity_ = 0;
+    }
+    return *this;
+  }
+
+  ~pooled_message()
+  {
+    release();
+  }
+
+  pooled_message clone() const
+  {
+    pooled_message copy(format_);
+    static_cast<chat_header&>(copy) = *this;
+    copy.reserve(body_length_);
+    std::memcpy(copy.data(), data(), length());
+    return copy;
+  }
+
+  const char* data() const
+  {
+    return block_;
+  }
+
+  char* data()
+  {
+    return block_;
+  }
+
+  std::size_t length() const
+  {
+    return header_size() + body_length_;
+  }
+
+  const char* body() const
+  {
+    return block_ + header_size();
+  }
+
+  char* body()
+  {
+    return block_ + header_size();
+  }
+
+  std::size_t body_length() const
+  {
+    return body_length_;
+  }
+
+  // Resizes the body, clamped to max_body_length(). The existing body is
+  // kept up to the new length.
+  void body_length(std::size_t new_length)
+  {
+    if (new_length > max_body_length())
+      new_length = max_body_length();
+    reserve(new_length);
+    body_length_ = new_length;
+  }
+
+  header_format format() const
+  {
+    return format_;
+  }
+
+  // Switches the header format, keeping the body directly behind the
+  // header. The header must be encoded again afterwards.
+  void format(header_format new_format)
+  {
+    if (new_format == format_)
+      return;
+    std::size_t old_header = header_size();
+    format_ = new_format;
+    reserve(body_length_, old_header);
+    std::memmove(body(), block_ + old_header, body_length_);
+  }
+
+  bool is_hello() const
+  {
+    return chat_header::is_hello(body());
+  }
+
+  // Adopts a header already decoded into h, allocating room for its body.
+  // The encoded header bytes are written to the front of the block.
+  void assign_header(const chat_header& h)
+  {
+    static_cast<chat_header&>(*this) = h;
+    std::size_t length = body_length_;
+    body_length_ = 0;
+    reserve(length);
+    body_length_ = length;
+    encode_header();
+  }
+
+  void encode_header()
+  {
+    chat_header::encode_header(block_);
+  }
+
+private:
+  static std::size_t& max_body_length_ref()
+  {
+    static std::size_t n = legacy_max_body_length;
+    return n;
+  }
+
+  // Makes the block big enough for the current header plus body bytes. If
+  // the block moves, the header and body are copied from their old offsets.
+  void reserve(std::size_t body, std::size_t old_header = 0)
+  {
+    std::size_t needed = header_size() + body;
+    if (needed <= capacity_)
+      return;
+    std::size_t capacity = 0;
+    char* block = message_pool::instance().allocate(needed, capacity);
+    if (block_)
+    {
+      if (old_header == 0)
+        old_header = header_size();
+      std::memcpy(block, block_, old_header + body_length_);
+      message_pool::instance().deallocate(block_, capacity_);
+    }
+    block_ = block;
+    capacity_ = capacity;
+  }
+
+  void release()
+  {
+    if (block_)
+      message_pool::instance().deallocate(block_, capacity_);
+    block_ = 0;
+    capacity_ = 0;
+  }
+
+  pooled_message(const pooled_message&);
+  pooled_message& operator=(const pooled_message&);
+
+  char* block_;
+  std::size_t capacity_;
+};
+
+#endif // POOLED_MESSAGE_HPP
@@ -0,0 +1,147 @@
+//
+// relay_message.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Immutable, reference-counted messages fanned out by the relay.
+//
+
+#ifndef RELAY_MESSAGE_HPP
+#define RELAY_MESSAGE_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include "kinect_command.hpp"
+#include "pooled_message.hpp"
+
+// A message as received, written once and then shared by the room history
+// and every session that queues it. Peers that negotiated the other header
+// format get a second encoding, built the first time one of them asks for
+// it and shared from then on, so fan-out cost does not grow with the number
+// of subscribers.
+class relay_message
+{
+public:
+  // How a session treats the message when its peer falls behind.
+  enum traffic_class
+  {
+    control_class,  // button, stop, hellos and heartbeats; never dropped
+    steering_class, // forward, left and right; only the newest matters
+    bulk_class,     // everything else
+    traffic_classes
+  };
+
+  explicit relay_message(pooled_message&& msg)
+    : native_(std::move(msg)),
+      received_(std::chrono::steady_clock::now()),
+      topic_(chat_header::data_topic),
+      traffic_(bulk_class)
+  {
+    kinect_command cmd;
+    if (native_.type() == chat_header::hello_type
+        || native_.is_heartbeat())
+    {
+      traffic_ = control_class;
+    }
+    else if (cmd.decode(native_))
+    {
+      topic_ = cmd.topic();
+      traffic_ = classify(cmd.op());
+    }
+  }
+
+  const pooled_message& native() const
+  {
+    return native_;
+  }
+
+  std::size_t body_length() const
+  {
+    return native_.body_length();
+  }
+
+  // When the relay read it, for deliver latency.
+  std::chrono::steady_clock::time_point received() const
+  {
+    return received_;
+  }
+
+  chat_header::topic topic() const
+  {
+    return topic_;
+  }
+
+  traffic_class traffic() const
+  {
+    return traffic_;
+  }
+
+  const pooled_message& encoded(chat_header::header_format format) const
+  {
+    if (format == native_.format())
+      return native_;
+    std::call_once(converted_once_, [this, format]()
+        {
+          converted_ = convert(format);
+        });
+    return converted_;
+  }
+
+private:
+  static traffic_class classify(kinect_command::opcode op)
+  {
+    switch (op)
+    {
+    case kinect_command::forward:
+    case kinect_command::left:
+    case kinect_command::right:
+      return steering_class;
+    case kinect_command::stop:
+    case kinect_command::button:
+      return control_class;
+    default:
+      return bulk_class;
+    }
+  }
+
+  pooled_message convert(chat_header::header_format format) const
+  {
+    kinect_command cmd;
+    if (native_.type() == chat_header::command_type && cmd.decode(native_))
+    {
+      // v1 peers only understand the legacy command text.
+      pooled_message legacy(format);
+      cmd.encode(legacy);
+      legacy.sequence(native_.sequence());
+      legacy.encode_header();
+      return legacy;
+    }
+
+    pooled_message copy(native_.clone());
+    copy.format(format);
+    copy.encode_header();
+    return copy;
+  }
+
+  relay_message(const relay_message&);
+  relay_message& operator=(const relay_message&);
+
+  pooled_message native_;
+  std::chrono::steady_clock::time_point received_;
+  chat_header::topic topic_;
+  traffic_class traffic_;
+  mutable std::once_flag converted_once_;
+  mutable pooled_message converted_;
+};
+
+typedef std::shared_ptr<const relay_message> relay_message_ptr;
+
+// Control block and message come from message_pool, not the heap.
+inline relay_message_ptr make_relay_message(pooled_message&& msg)
+{
+  return std::allocate_shared<relay_message>(
+      pool_allocator<relay_message>(), std::move(msg));
+}
+
+#endif // RELAY_MESSAGE_HPP
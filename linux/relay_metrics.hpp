@@ -0,0 +1,403 @@
+//
+// relay_metrics.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Process-wide counters for the relay, and the per-session and per-room
+// ones a scrape walks.
+//
+
+#ifndef RELAY_METRICS_HPP
+#define RELAY_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Updated from every session with relaxed atomics; readers only need a
+// roughly consistent snapshot.
+class relay_metrics
+{
+public:
+  static relay_metrics& instance()
+  {
+    static relay_metrics metrics;
+    return metrics;
+  }
+
+  // One async_write that carried messages frames, bytes in total.
+  void record_write(std::size_t messages, std::size_t bytes)
+  {
+    write_ops_.fetch_add(1, std::memory_order_relaxed);
+    messages_written_.fetch_add(messages, std::memory_order_relaxed);
+    bytes_written_.fetch_add(bytes, std::memory_order_relaxed);
+    std::uint64_t batch = messages;
+    std::uint64_t largest = largest_batch_.load(std::memory_order_relaxed);
+    while (batch > largest && !largest_batch_.compare_exchange_weak(
+          largest, batch, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  // One socket read and the number of frames it completed.
+  void record_read(std::size_t frames, std::size_t bytes)
+  {
+    read_ops_.fetch_add(1, std::memory_order_relaxed);
+    frames_read_.fetch_add(frames, std::memory_order_relaxed);
+    bytes_read_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  // A session dropped an unsent message because its queue for that class
+  // was full. Replaced steering commands are counted on their own.
+  void record_drop(bool steering)
+  {
+    if (steering)
+      steering_replaced_.fetch_add(1, std::memory_order_relaxed);
+    else
+      messages_dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // A session dropped a message with a body larger than its peer takes.
+  void record_too_large()
+  {
+    messages_too_large_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The deepest any session's write queue has been.
+  void record_queue_depth(std::size_t depth)
+  {
+    std::uint64_t d = depth;
+    std::uint64_t deepest = queue_high_water_.load(std::memory_order_relaxed);
+    while (d > deepest && !queue_high_water_.compare_exchange_weak(
+          deepest, d, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  // A steering datagram, and whether it was newer than everything already
+  // seen from its sender.
+  void record_datagram(bool fresh)
+  {
+    datagrams_received_.fetch_add(1, std::memory_order_relaxed);
+    if (!fresh)
+      stale_datagrams_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // A command from a peer, and whether it was forwarded or coalesced into
+  // the run it repeats.
+  void record_command(bool forwarded)
+  {
+    commands_received_.fetch_add(1, std::memory_order_relaxed);
+    if (!forwarded)
+      commands_coalesced_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // While one is alive, allocations on its thread are counted as
+  // stats_allocations rather than heap_allocations, so that printing the
+  // stats does not show up as message-path allocations.
+  class dump_scope
+  {
+  public:
+    dump_scope()
+    {
+      dumping() = true;
+    }
+
+    ~dump_scope()
+    {
+      dumping() = false;
+    }
+
+  private:
+    dump_scope(const dump_scope&);
+    dump_scope& operator=(const dump_scope&);
+  };
+
+  // Only called, and only reported, when chat_server is built with
+  // RELAY_COUNT_ALLOCATIONS, as make chat_server_counting does.
+  void record_allocation()
+  {
+    if (dumping())
+      stats_allocations_.fetch_add(1, std::memory_order_relaxed);
+    else
+      heap_allocations_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void dump(std::ostream& os) const
+  {
+    std::uint64_t reads = read_ops_.load(std::memory_order_relaxed);
+    std::uint64_t frames = frames_read_.load(std::memory_order_relaxed);
+    os << "read_ops " << reads << "\n";
+    os << "frames_read " << frames << "\n";
+    os << "bytes_read "
+      << bytes_read_.load(std::memory_order_relaxed) << "\n";
+    os << "frames_per_read "
+      << (reads ? double(frames) / reads : 0.0) << "\n";
+    std::uint64_t ops = write_ops_.load(std::memory_order_relaxed);
+    std::uint64_t msgs = messages_written_.load(std::memory_order_relaxed);
+    os << "write_ops " << ops << "\n";
+    os << "messages_written " << msgs << "\n";
+    os << "bytes_written "
+      << bytes_written_.load(std::memory_order_relaxed) << "\n";
+    os << "messages_per_write " << (ops ? double(msgs) / ops : 0.0) << "\n";
+    os << "largest_write_batch "
+      << largest_batch_.load(std::memory_order_relaxed) << "\n";
+    os << "steering_replaced "
+      << steering_replaced_.load(std::memory_order_relaxed) << "\n";
+    os << "messages_dropped "
+      << messages_dropped_.load(std::memory_order_relaxed) << "\n";
+    os << "messages_too_large "
+      << messages_too_large_.load(std::memory_order_relaxed) << "\n";
+    os << "queue_high_water "
+      << queue_high_water_.load(std::memory_order_relaxed) << "\n";
+    os << "datagrams_received "
+      << datagrams_received_.load(std::memory_order_relaxed) << "\n";
+    os << "stale_datagrams "
+      << stale_datagrams_.load(std::memory_order_relaxed) << "\n";
+    std::uint64_t commands =
+      commands_received_.load(std::memory_order_relaxed);
+    std::uint64_t coalesced =
+      commands_coalesced_.load(std::memory_order_relaxed);
+    os << "commands_received " << commands << "\n";
+    os << "commands_coalesced " << coalesced << "\n";
+    os << "command_suppression_ratio "
+      << (commands ? double(coalesced) / commands : 0.0) << "\n";
+#if defined(RELAY_COUNT_ALLOCATIONS)
+    os << "heap_allocations "
+      << heap_allocations_.load(std::memory_order_relaxed) << "\n";
+    os << "stats_allocations "
+      << stats_allocations_.load(std::memory_order_relaxed) << "\n";
+#endif // defined(RELAY_COUNT_ALLOCATIONS)
+  }
+
+private:
+  relay_metrics()
+    : read_ops_(0),
+      frames_read_(0),
+      bytes_read_(0),
+      write_ops_(0),
+      messages_written_(0),
+      bytes_written_(0),
+      largest_batch_(0),
+      steering_replaced_(0),
+      messages_dropped_(0),
+      messages_too_large_(0),
+      queue_high_water_(0),
+      datagrams_received_(0),
+      stale_datagrams_(0),
+      commands_received_(0),
+      commands_coalesced_(0),
+      heap_allocations_(0),
+      stats_allocations_(0)
+  {
+  }
+
+  static bool& dumping()
+  {
+    static thread_local bool d = false;
+    return d;
+  }
+
+  std::atomic<std::uint64_t> read_ops_;
+  std::atomic<std::uint64_t> frames_read_;
+  std::atomic<std::uint64_t> bytes_read_;
+  std::atomic<std::uint64_t> write_ops_;
+  std::atomic<std::uint64_t> messages_written_;
+  std::atomic<std::uint64_t> bytes_written_;
+  std::atomic<std::uint64_t> largest_batch_;
+  std::atomic<std::uint64_t> steering_replaced_;
+  std::atomic<std::uint64_t> messages_dropped_;
+  std::atomic<std::uint64_t> messages_too_large_;
+  std::atomic<std::uint64_t> queue_high_water_;
+  std::atomic<std::uint64_t> datagrams_received_;
+  std::atomic<std::uint64_t> stale_datagrams_;
+  std::atomic<std::uint64_t> commands_received_;
+  std::atomic<std::uint64_t> commands_coalesced_;
+  std::atomic<std::uint64_t> heap_allocations_;
+  std::atomic<std::uint64_t> stats_allocations_;
+};
+
+//----------------------------------------------------------------------
+
+// A counter that one thread at a time writes and any thread reads. A plain
+// relaxed load and store, so the writer never pays for a locked add.
+class metric_counter
+{
+public:
+  metric_counter()
+    : value_(0)
+  {
+  }
+
+  void add(std::uint64_t n)
+  {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+  }
+
+  void set(std::uint64_t v)
+  {
+    value_.store(v, std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const
+  {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<std::uint64_t> value_;
+};
+
+// Latencies in power-of-two buckets of microseconds: bucket 0 holds 0, and
+// bucket i holds [2^(i-1), 2^i). A quantile comes back as the upper bound
+// of its bucket, so it is right to within a factor of two.
+class latency_histogram
+{
+public:
+  enum { bucket_count = 32 };
+
+  latency_histogram()
+  {
+    for (auto& b: buckets_)
+      b.store(0, std::memory_order_relaxed);
+  }
+
+  void record(std::uint64_t us)
+  {
+    std::size_t i = 0;
+    while (us != 0 && i + 1 < bucket_count)
+    {
+      us >>= 1;
+      ++i;
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void merge(const latency_histogram& other)
+  {
+    for (std::size_t i = 0; i < bucket_count; ++i)
+      buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+  }
+
+  std::uint64_t count() const
+  {
+    std::uint64_t n = 0;
+    for (auto& b: buckets_)
+      n += b.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  std::uint64_t quantile(double q) const
+  {
+    std::uint64_t n = count();
+    std::uint64_t rank = static_cast<std::uint64_t>(q * n);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen > rank)
+        return i == 0 ? 0 : std::uint64_t(1) << i;
+    }
+    return 0;
+  }
+
+  // name_count and name{quantile="..."} lines, labels inside the braces.
+  void dump(std::ostream& os, const char* name,
+      const std::string& labels) const
+  {
+    static const char* quantiles[] = { "0.5", "0.99", "0.999" };
+    static const double values[] = { 0.5, 0.99, 0.999 };
+    os << name << "_count{" << labels << "} " << count() << "\n";
+    for (std::size_t i = 0; i < 3; ++i)
+      os << name << "{" << labels << ",quantile=\"" << quantiles[i] << "\"} "
+        << quantile(values[i]) << "\n";
+  }
+
+private:
+  std::atomic<std::uint64_t> buckets_[bucket_count];
+};
+
+// Why a session left its room.
+enum disconnect_reason
+{
+  peer_closed,  // orderly close by the peer
+  read_error,
+  write_error,
+  bad_frame,    // the peer sent something that does not parse
+  peer_gone,    // a shared-memory peer let go or died
+  idle_timeout, // silent through the heartbeats, or not taking writes
+  disconnect_reasons
+};
+
+inline const char* disconnect_reason_name(disconnect_reason r)
+{
+  static const char* names[] =
+  {
+    "peer_closed", "read_error", "write_error", "bad_frame", "peer_gone",
+    "idle_timeout"
+  };
+  return names[r];
+}
+
+// One session's traffic, written from its own serial context.
+struct session_metrics
+{
+  metric_counter frames_in;
+  metric_counter bytes_in;
+  metric_counter messages_out;
+  metric_counter bytes_out;
+  metric_counter queue_depth;
+  metric_counter queue_high_water;
+  metric_counter dropped;
+  // From the relay reading a message to writing it to this peer.
+  latency_histogram deliver_latency;
+
+  void dump(std::ostream& os, const std::string& labels) const
+  {
+    os << "session_frames_in{" << labels << "} " << frames_in.value() << "\n";
+    os << "session_bytes_in{" << labels << "} " << bytes_in.value() << "\n";
+    os << "session_messages_out{" << labels << "} "
+      << messages_out.value() << "\n";
+    os << "session_bytes_out{" << labels << "} " << bytes_out.value() << "\n";
+    os << "session_queue_depth{" << labels << "} "
+      << queue_depth.value() << "\n";
+    os << "session_queue_high_water{" << labels << "} "
+      << queue_high_water.value() << "\n";
+    os << "session_dropped{" << labels << "} " << dropped.value() << "\n";
+    deliver_latency.dump(os, "session_deliver_latency_us", labels);
+  }
+};
+
+// A room's totals. The counters are written under the room's lock;
+// disconnects come from any session.
+struct room_metrics
+{
+  room_metrics()
+  {
+    for (auto& n: disconnects)
+      n.store(0, std::memory_order_relaxed);
+  }
+
+  void record_disconnect(disconnect_reason r)
+  {
+    disconnects[r].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void dump(std::ostream& os, const std::string& labels) const
+  {
+    os << "room_messages{" << labels << "} " << messages.value() << "\n";
+    os << "room_deliveries{" << labels << "} " << deliveries.value() << "\n";
+    for (std::size_t i = 0; i < disconnect_reasons; ++i)
+      os << "room_disconnects{" << labels << ",reason=\""
+        << disconnect_reason_name(static_cast<disconnect_reason>(i))
+        << "\"} " << disconnects[i].load(std::memory_order_relaxed) << "\n";
+  }
+
+  metric_counter messages;
+  metric_counter deliveries;
+  std::atomic<std::uint64_t> disconnects[disconnect_reasons];
+};
+
+#endif // RELAY_METRICS_HPP
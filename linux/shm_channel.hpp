@@ -0,0 +1,307 @@
+//
+// shm_channel.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Shared-memory link between the relay and a peer on the same machine.
+//
+
+#ifndef SHM_CHANNEL_HPP
+#define SHM_CHANNEL_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+    "shm_ring needs atomics that work across processes");
+
+// A single-producer, single-consumer byte ring that lives in shared memory
+// and carries a frame stream exactly as a socket would. Positions run
+// freely and wrap at 2^32.
+//
+// A consumer that finds the ring empty says so in sleeping_ and waits on
+// the signal_ futex. The producer publishes with write() and calls notify()
+// once per batch, which only makes the wake system call if the consumer
+// said it was going to sleep, so a busy ring costs no system calls at all.
+class shm_ring
+{
+public:
+  enum { capacity = 1 << 16 };
+
+  // Only while neither end is using the ring.
+  void reset()
+  {
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+    sleeping_.store(0, std::memory_order_relaxed);
+  }
+
+  bool empty() const
+  {
+    return tail_.load(std::memory_order_seq_cst)
+      == head_.load(std::memory_order_relaxed);
+  }
+
+  // Producer. Copies as much of [p, p + n) as fits and returns how much.
+  std::size_t write(const char* p, std::size_t n)
+  {
+    std::uint32_t tail = tail_.load(std::memory_order_relaxed);
+    std::uint32_t head = head_.load(std::memory_order_acquire);
+    std::size_t space = capacity - (tail - head);
+    if (n > space)
+      n = space;
+    std::size_t offset = tail & (capacity - 1);
+    std::size_t first = n < capacity - offset ? n : capacity - offset;
+    std::memcpy(data_ + offset, p, first);
+    std::memcpy(data_, p + first, n - first);
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  // Producer. Wakes the consumer if it is waiting for what was written.
+  void notify()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed))
+      interrupt();
+  }
+
+  // Consumer. Copies up to n bytes out and returns how many.
+  std::size_t read(char* p, std::size_t n)
+  {
+    std::uint32_t head = head_.load(std::memory_order_relaxed);
+    std::uint32_t tail = tail_.load(std::memory_order_acquire);
+    std::size_t available = tail - head;
+    if (n > available)
+      n = available;
+    std::size_t offset = head & (capacity - 1);
+    std::size_t first = n < capacity - offset ? n : capacity - offset;
+    std::memcpy(p, data_ + offset, first);
+    std::memcpy(p + first, data_, n - first);
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer. Taken before checking whatever else interrupt() is called
+  // for, and passed to wait(), so that an interrupt in between is not lost.
+  std::uint32_t signal() const
+  {
+    return signal_.load(std::memory_order_acquire);
+  }
+
+  // Consumer. Returns once the ring has data, after interrupt(), or after
+  // timeout_ms, whichever comes first.
+  void wait(int timeout_ms)
+  {
+    wait(signal(), timeout_ms);
+  }
+
+  void wait(std::uint32_t signal, int timeout_ms)
+  {
+    sleeping_.store(1, std::memory_order_seq_cst);
+    if (empty())
+    {
+      timespec timeout;
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      ::syscall(SYS_futex, futex_word(), FUTEX_WAIT, signal, &timeout, 0, 0);
+    }
+    sleeping_.store(0, std::memory_order_relaxed);
+  }
+
+  // Wakes the consumer whether or not there is anything to read.
+  void interrupt()
+  {
+    signal_.fetch_add(1, std::memory_order_release);
+    ::syscall(SYS_futex, futex_word(), FUTEX_WAKE, 1, 0, 0, 0);
+  }
+
+private:
+  std::uint32_t* futex_word()
+  {
+    return reinterpret_cast<std::uint32_t*>(&signal_);
+  }
+
+  alignas(64) std::atomic<std::uint32_t> head_;
+  alignas(64) std::atomic<std::uint32_t> tail_;
+  std::atomic<std::uint32_t> signal_;
+  std::atomic<std::uint32_t> sleeping_;
+  alignas(64) char data_[capacity];
+};
+
+// One segment per relay port, created and owned by the relay. A peer on the
+// same machine claims it by swapping its pid into peer_, and gives it back
+// by storing minus that pid; the relay then clears the rings and frees the
+// claim for the next peer. Either end checks that the other is still alive
+// with kill(pid, 0), so a crash on one side is noticed by the other.
+class shm_channel
+{
+public:
+  static std::string name_for_port(unsigned short port)
+  {
+    return "/chat_relay." + std::to_string(port);
+  }
+
+  // Relay side. Replaces any segment an earlier relay left behind.
+  static std::unique_ptr<shm_channel> create(const std::string& name)
+  {
+    ::shm_unlink(name.c_str());
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      throw std::system_error(errno, std::system_category(), "shm_open");
+    if (::ftruncate(fd, sizeof(segment)) != 0)
+    {
+      int error = errno;
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw std::system_error(error, std::system_category(), "ftruncate");
+    }
+    std::unique_ptr<shm_channel> channel(new shm_channel(name, true));
+    channel->map(fd);
+    segment* s = channel->segment_;
+    s->relay = ::getpid();
+    s->peer.store(0, std::memory_order_relaxed);
+    s->to_peer.reset();
+    s->to_relay.reset();
+    s->magic.store(segment_magic, std::memory_order_release);
+    return channel;
+  }
+
+  // Peer side. Null unless a live relay has the segment and no other peer
+  // has claimed it.
+  static std::unique_ptr<shm_channel> attach(const std::string& name)
+  {
+    std::unique_ptr<shm_channel> channel;
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return channel;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < std::int64_t(sizeof(segment)))
+    {
+      ::close(fd);
+      return channel;
+    }
+    channel.reset(new shm_channel(name, false));
+    try
+    {
+      channel->map(fd);
+    }
+    catch (std::system_error&)
+    {
+      channel.reset();
+      return channel;
+    }
+    segment* s = channel->segment_;
+    std::int32_t free = 0;
+    if (s->magic.load(std::memory_order_acquire) != segment_magic
+        || !alive(s->relay)
+        || !s->peer.compare_exchange_strong(free, ::getpid()))
+      channel.reset();
+    else
+      channel->attached_ = true;
+    return channel;
+  }
+
+  ~shm_channel()
+  {
+    if (relay_)
+      ::shm_unlink(name_.c_str());
+    if (!segment_)
+      return;
+    if (attached_)
+    {
+      segment_->peer.store(-::getpid(), std::memory_order_release);
+      segment_->to_relay.interrupt();
+    }
+    ::munmap(segment_, sizeof(segment));
+  }
+
+  shm_ring& to_peer()
+  {
+    return segment_->to_peer;
+  }
+
+  shm_ring& to_relay()
+  {
+    return segment_->to_relay;
+  }
+
+  // Relay side. The pid of the peer holding the claim, or 0 if none does.
+  // A negative pid is a peer that has let go.
+  std::int32_t peer() const
+  {
+    return segment_->peer.load(std::memory_order_acquire);
+  }
+
+  // Relay side, once the peer has gone and nothing uses the rings.
+  void release_peer()
+  {
+    segment_->to_peer.reset();
+    segment_->to_relay.reset();
+    segment_->peer.store(0, std::memory_order_release);
+  }
+
+  // Peer side.
+  bool relay_alive() const
+  {
+    return alive(segment_->relay);
+  }
+
+  static bool alive(std::int32_t pid)
+  {
+    return pid > 0 && (::kill(pid, 0) == 0 || errno == EPERM);
+  }
+
+private:
+  enum { segment_magic = 0x43485331 };
+
+  struct segment
+  {
+    std::atomic<std::uint32_t> magic;
+    std::int32_t relay;
+    std::atomic<std::int32_t> peer;
+    shm_ring to_peer;
+    shm_ring to_relay;
+  };
+
+  shm_channel(const std::string& name, bool relay)
+    : name_(name),
+      relay_(relay),
+      attached_(false),
+      segment_(0)
+  {
+  }
+
+  shm_channel(const shm_channel&);
+  shm_channel& operator=(const shm_channel&);
+
+  void map(int fd)
+  {
+    void* p = ::mmap(0, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (p == MAP_FAILED)
+      throw std::system_error(error, std::system_category(), "mmap");
+    segment_ = static_cast<segment*>(p);
+  }
+
+  std::string name_;
+  bool relay_;
+  bool attached_;
+  segment* segment_;
+};
+
+#endif // SHM_CHANNEL_HPP
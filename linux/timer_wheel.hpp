@@ -0,0 +1,162 @@
+//
+// timer_wheel.hpp
+// ~~~~~~~~~~~~~~~
+//
+// One timer shared by many sessions.
+//
+
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "asio.hpp"
+
+// A hashed timing wheel. It advances one slot per tick, and a target due n
+// ticks from now sits in slot (now + n) % slots until its tick comes round,
+// so scheduling is a push onto a list and a tick only looks at one slot
+// however many targets are waiting. Targets are held weakly: one that goes
+// away is dropped when its slot comes up, and is never cancelled.
+//
+// Given an io_service, the wheel ticks itself with a steady_timer and calls
+// Target::timer_expired() from that io_service. Otherwise its owner calls
+// advance() once per tick. Entries are linked through nodes that the wheel
+// keeps for reuse, so once it has held as many targets as it ever will, a
+// wheel never allocates.
+template <typename Target>
+class timer_wheel
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  timer_wheel(asio::io_service& io_service, clock::duration tick,
+      std::size_t slot_count = 512)
+    : timer_(new asio::steady_timer(io_service)),
+      tick_(tick),
+      slots_(slot_count),
+      expired_(0),
+      free_(0),
+      now_(0),
+      next_tick_(clock::now())
+  {
+    do_tick();
+  }
+
+  explicit timer_wheel(clock::duration tick, std::size_t slot_count = 512)
+    : tick_(tick),
+      slots_(slot_count),
+      expired_(0),
+      free_(0),
+      now_(0)
+  {
+  }
+
+  ~timer_wheel()
+  {
+    for (auto& slot: slots_)
+      destroy(slot);
+    destroy(free_);
+  }
+
+  // May be called from any thread.
+  void schedule(const std::shared_ptr<Target>& target, clock::duration after)
+  {
+    std::uint64_t ticks = (after + tick_ - clock::duration(1)) / tick_;
+    if (ticks == 0)
+      ticks = 1;
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry* e = free_;
+    if (e)
+      free_ = e->next;
+    else
+      e = new entry;
+    e->target = target;
+    e->due = now_ + ticks;
+    entry*& slot = slots_[e->due % slots_.size()];
+    e->next = slot;
+    slot = e;
+  }
+
+  // Takes the entries due now out of the current slot under the lock, and
+  // calls them without it, so a target may schedule itself again.
+  void advance()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++now_;
+      entry** link = &slots_[now_ % slots_.size()];
+      while (entry* e = *link)
+      {
+        if (e->due <= now_)
+        {
+          *link = e->next;
+          e->next = expired_;
+          expired_ = e;
+        }
+        else
+        {
+          link = &e->next;
+        }
+      }
+    }
+    for (entry* e = expired_; e; e = e->next)
+    {
+      if (std::shared_ptr<Target> target = e->target.lock())
+        target->timer_expired();
+      e->target.reset();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (entry* e = expired_)
+    {
+      expired_ = e->next;
+      e->next = free_;
+      free_ = e;
+    }
+  }
+
+private:
+  struct entry
+  {
+    std::weak_ptr<Target> target;
+    std::uint64_t due;
+    entry* next;
+  };
+
+  static void destroy(entry* e)
+  {
+    while (e)
+    {
+      entry* next = e->next;
+      delete e;
+      e = next;
+    }
+  }
+
+  void do_tick()
+  {
+    next_tick_ += tick_;
+    timer_->expires_at(next_tick_);
+    timer_->async_wait(
+        [this](const asio::error_code& ec)
+        {
+          if (ec)
+            return;
+          advance();
+          do_tick();
+        });
+  }
+
+  std::unique_ptr<asio::steady_timer> timer_;
+  clock::duration tick_;
+  std::mutex mutex_;
+  std::vector<entry*> slots_;
+  entry* expired_;
+  entry* free_;
+  std::uint64_t now_;
+  clock::time_point next_tick_;
+};
+
+#endif // TIMER_WHEEL_HPP
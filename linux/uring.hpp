@@ -0,0 +1,348 @@
+//
+// uring.hpp
+// ~~~~~~~~~
+//
+// A minimal io_uring ring over the raw system calls.
+//
+
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <vector>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// One submission and one completion queue, mapped once. Operations are
+// prepared into the submission queue while completions are handled and
+// reach the kernel together in submit_and_wait(), so a single system call
+// carries every accept, recv and send the last batch produced. A ring
+// belongs to the one thread that runs its loop.
+class uring
+{
+public:
+  explicit uring(unsigned entries)
+    : fd_(-1),
+      sq_ring_(MAP_FAILED),
+      cq_ring_(MAP_FAILED),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sq_tail_(0)
+  {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+    if (fd_ < 0)
+      throw std::system_error(errno, std::system_category(),
+          "io_uring_setup");
+    try
+    {
+      map_rings(p);
+    }
+    catch (...)
+    {
+      release();
+      throw;
+    }
+  }
+
+  ~uring()
+  {
+    release();
+  }
+
+  // Whether this kernel, and whatever sandbox the process runs in, lets us
+  // set up a ring at all.
+  static bool available()
+  {
+    try
+    {
+      uring probe(2);
+      return true;
+    }
+    catch (std::system_error&)
+    {
+      return false;
+    }
+  }
+
+  void prep_accept(int fd, std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_ACCEPT, fd, user_data);
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+
+  void prep_recv(int fd, void* buffer, std::size_t length,
+      std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_RECV, fd, user_data);
+    sqe->addr = reinterpret_cast<std::uintptr_t>(buffer);
+    sqe->len = static_cast<unsigned>(length);
+  }
+
+  // A read into memory registered at buffer_index, which saves the kernel
+  // pinning the pages on every call.
+  void prep_read_fixed(int fd, void* buffer, std::size_t length,
+      unsigned buffer_index, std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_READ_FIXED, fd, user_data);
+    sqe->addr = reinterpret_cast<std::uintptr_t>(buffer);
+    sqe->len = static_cast<unsigned>(length);
+    sqe->buf_index = static_cast<std::uint16_t>(buffer_index);
+  }
+
+  void prep_read(int fd, void* buffer, std::size_t length,
+      std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_READ, fd, user_data);
+    sqe->addr = reinterpret_cast<std::uintptr_t>(buffer);
+    sqe->len = static_cast<unsigned>(length);
+  }
+
+  void prep_sendmsg(int fd, const msghdr* msg, std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_SENDMSG, fd, user_data);
+    sqe->addr = reinterpret_cast<std::uintptr_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+
+  void prep_timeout(const __kernel_timespec* ts, std::uint64_t user_data)
+  {
+    io_uring_sqe* sqe = get_sqe(IORING_OP_TIMEOUT, -1, user_data);
+    sqe->addr = reinterpret_cast<std::uintptr_t>(ts);
+    sqe->len = 1;
+  }
+
+  // Hands everything prepared so far to the kernel and, if wait_nr is not
+  // zero, waits until that many completions are ready.
+  void submit_and_wait(unsigned wait_nr)
+  {
+    unsigned pending =
+      sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE);
+    __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (::syscall(__NR_io_uring_enter, fd_, pending, wait_nr, flags, 0, 0) < 0
+        && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      throw std::system_error(errno, std::system_category(),
+          "io_uring_enter");
+  }
+
+  // Calls f(user_data, result) for every completion that is ready and
+  // returns how many there were. f may prepare new operations.
+  template <typename Function>
+  unsigned complete(Function f)
+  {
+    unsigned head = *cq_khead_;
+    unsigned count = 0;
+    while (head != __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE))
+    {
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_khead_, ++head, __ATOMIC_RELEASE);
+      f(cqe.user_data, cqe.res);
+      ++count;
+    }
+    return count;
+  }
+
+  // Registers count buffers for prep_read_fixed().
+  bool register_buffers(const iovec* buffers, unsigned count)
+  {
+    return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+        buffers, count) == 0;
+  }
+
+  // Reserves count empty slots that update_buffer() fills in later.
+  bool register_sparse_buffers(unsigned count)
+  {
+    io_uring_rsrc_register r;
+    std::memset(&r, 0, sizeof(r));
+    r.nr = count;
+    r.flags = IORING_RSRC_REGISTER_SPARSE;
+    return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS2,
+        &r, sizeof(r)) == 0;
+  }
+
+  bool update_buffer(unsigned index, void* base, std::size_t length)
+  {
+    iovec iov;
+    iov.iov_base = base;
+    iov.iov_len = length;
+    io_uring_rsrc_update2 u;
+    std::memset(&u, 0, sizeof(u));
+    u.offset = index;
+    u.data = reinterpret_cast<std::uintptr_t>(&iov);
+    u.nr = 1;
+    return ::syscall(__NR_io_uring_register, fd_,
+        IORING_REGISTER_BUFFERS_UPDATE, &u, sizeof(u)) == 1;
+  }
+
+private:
+  void map_rings(const io_uring_params& p)
+  {
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_ring_size_ > sq_ring_size_)
+      sq_ring_size_ = cq_ring_size_;
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap
+      ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_khead_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_ktail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sq_entries_ = p.sq_entries;
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_khead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_ktail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    sq_tail_ = *sq_ktail_;
+  }
+
+  void release()
+  {
+    if (sqes_ != MAP_FAILED)
+      ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+      ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+      ::munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  void* map(std::size_t size, off_t offset)
+  {
+    void* p = ::mmap(0, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (p == MAP_FAILED)
+      throw std::system_error(errno, std::system_category(), "mmap");
+    return p;
+  }
+
+  // The next free submission entry, cleared. A full queue is submitted
+  // first; without SQPOLL the kernel takes every entry during the call.
+  io_uring_sqe* get_sqe(std::uint8_t opcode, int fd, std::uint64_t user_data)
+  {
+    unsigned head = __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE);
+    if (sq_tail_ - head == sq_entries_)
+      submit_and_wait(0);
+    unsigned index = sq_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    ++sq_tail_;
+    return sqe;
+  }
+
+  uring(const uring&);
+  uring& operator=(const uring&);
+
+  int fd_;
+  void* sq_ring_;
+  void* cq_ring_;
+  io_uring_sqe* sqes_;
+  std::size_t sq_ring_size_;
+  std::size_t cq_ring_size_;
+  std::size_t sqes_size_;
+  unsigned* sq_khead_;
+  unsigned* sq_ktail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned sq_tail_;
+  unsigned* cq_khead_;
+  unsigned* cq_ktail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+};
+
+// A gathered send of several buffers. The kernel may take less than all of
+// it in one sendmsg; sent() then submits the rest.
+class uring_send
+{
+public:
+  explicit uring_send(std::size_t max_buffers)
+    : first_(0),
+      bytes_(0)
+  {
+    iovecs_.reserve(max_buffers);
+  }
+
+  void clear()
+  {
+    iovecs_.clear();
+    first_ = 0;
+    bytes_ = 0;
+  }
+
+  void push_back(const char* data, std::size_t length)
+  {
+    iovec iov;
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = length;
+    iovecs_.push_back(iov);
+  }
+
+  std::size_t size() const
+  {
+    return iovecs_.size();
+  }
+
+  // Bytes sent since clear().
+  std::size_t bytes() const
+  {
+    return bytes_;
+  }
+
+  void start(uring& ring, int fd, std::uint64_t user_data)
+  {
+    std::memset(&msghdr_, 0, sizeof(msghdr_));
+    msghdr_.msg_iov = &iovecs_[first_];
+    msghdr_.msg_iovlen = iovecs_.size() - first_;
+    ring.prep_sendmsg(fd, &msghdr_, user_data);
+  }
+
+  // Takes the result of the last sendmsg, which must have sent something.
+  // Returns true once every buffer has gone; otherwise the remainder has
+  // been submitted.
+  bool sent(uring& ring, int fd, std::uint64_t user_data, std::size_t n)
+  {
+    bytes_ += n;
+    while (first_ < iovecs_.size() && n >= iovecs_[first_].iov_len)
+      n -= iovecs_[first_++].iov_len;
+    if (first_ == iovecs_.size())
+      return true;
+    iovecs_[first_].iov_base = static_cast<char*>(iovecs_[first_].iov_base) + n;
+    iovecs_[first_].iov_len -= n;
+    start(ring, fd, user_data);
+    return false;
+  }
+
+private:
+  std::vector<iovec> iovecs_;
+  std::size_t first_;
+  std::size_t bytes_;
+  msghdr msghdr_;
+};
+
+#endif // URING_HPP
@@ -0,0 +1,113 @@
+//
+// command_deadline.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// How late a command is, on a clock that is not the sender's.
+//
+
+#ifndef COMMAND_DEADLINE_HPP
+#define COMMAND_DEADLINE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Ages stamped commands. The sender's clock is not ours, so receive time
+// minus issue time is the clock offset plus the trip, and the smallest
+// such delay is the offset plus the fastest trip. A command's age is how
+// much longer than that it took. The smallest delay is taken over the last
+// two windows, so drift between the clocks, or a sender restarted with a
+// new clock, is forgotten within two windows. Until then a sender whose
+// clock went back has all its commands found expired, which stops the
+// robot rather than moving it.
+class command_clock
+{
+public:
+  typedef std::chrono::steady_clock clock;
+  typedef std::chrono::milliseconds duration;
+
+  explicit command_clock(duration window = duration(10000))
+    : window_(window),
+      current_(0),
+      previous_(0),
+      has_current_(false),
+      has_previous_(false)
+  {
+  }
+
+  // The age of a command issued at issued ms on the sender's clock and
+  // received now, which also goes into the smallest delay.
+  duration observe(std::uint32_t issued, clock::time_point now)
+  {
+    if (!has_current_ || now - started_ >= window_)
+    {
+      has_previous_ = has_current_ && now - started_ < 2 * window_;
+      previous_ = current_;
+      has_current_ = false;
+      started_ = now;
+    }
+    std::uint32_t delay = ms(now) - issued;
+    if (!has_current_ || before(delay, current_))
+      current_ = delay;
+    has_current_ = true;
+    return age(issued, now);
+  }
+
+  // The same without taking the command into account.
+  duration age(std::uint32_t issued, clock::time_point now) const
+  {
+    if (!has_current_)
+      return duration(0);
+    std::uint32_t base = current_;
+    if (has_previous_ && before(previous_, base))
+      base = previous_;
+    std::int32_t age = static_cast<std::int32_t>(ms(now) - issued - base);
+    return duration(age > 0 ? age : 0);
+  }
+
+private:
+  static std::uint32_t ms(clock::time_point t)
+  {
+    return static_cast<std::uint32_t>(
+        std::chrono::duration_cast<duration>(t.time_since_epoch()).count());
+  }
+
+  // Whether delay a is smaller than b, with both wrapping at 2^32 ms.
+  static bool before(std::uint32_t a, std::uint32_t b)
+  {
+    return static_cast<std::int32_t>(a - b) < 0;
+  }
+
+  duration window_;
+  clock::time_point started_;
+  std::uint32_t current_;
+  std::uint32_t previous_;
+  bool has_current_;
+  bool has_previous_;
+};
+
+// What became of commands with a deadline.
+struct deadline_metrics
+{
+  deadline_metrics()
+    : stamped(0),
+      expired(0),
+      dropped(0),
+      timeouts(0)
+  {
+  }
+
+  void dump(std::ostream& os) const
+  {
+    os << "[deadline] " << stamped << " stamped, " << expired
+      << " expired on arrival, " << dropped << " dropped, " << timeouts
+      << " watchdog stops\n";
+  }
+
+  std::size_t stamped;  // commands that carried a deadline
+  std::size_t expired;  // of those, ones that arrived past it
+  std::size_t dropped;  // of those, ones not acted on; a late stop still is
+  std::size_t timeouts; // times no fresh command came in time to keep moving
+};
+
+#endif // COMMAND_DEADLINE_HPP
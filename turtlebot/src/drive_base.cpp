@@ -1,47 +1,182 @@
 #include <iostream>
 #include <ros/ros.h>
 #include <geometry_msgs/Twist.h>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
-#include <deque>
+#include <mutex>
 #include <thread>
+#include <vector>
 #include "asio.hpp"
 #include "chat_message.hpp"
+#include "command_deadline.hpp"
+#include "handler_allocator.hpp"
+#include "kinect_command.hpp"
+#include "reconnect_backoff.hpp"
+#include "shm_channel.hpp"
 
 using namespace std;
 
 using asio::ip::tcp;
 
-typedef std::deque<chat_message> chat_message_queue;
+typedef std::vector<chat_message> chat_message_queue;
 
+// drive() is called from the network threads and only sets the target
+// twist, run() publishes on a thread of its own at a fixed rate, moving
+// the published twist toward the target no faster than the acceleration
+// limits allow. actuation keeps its own clock however the commands arrive,
+// and a stop brakes instead of being a step to zero. a command moves the
+// robot until its deadline, and a stale one not at all, so a stalled
+// Kinect host brings the robot to a stop
 class Robot {
 
 	public:
-		Robot(ros::NodeHandle &nh) {
+		// ~control_rate is in Hz, ~max_linear_accel in m/s^2 and
+		// ~max_angular_accel in rad/s^2. ~command_timeout, in s, is how long
+		// a command without a deadline of its own is acted on, zero for
+		// until the next one
+		Robot(ros::NodeHandle &nh) : target_changed_(false), stopped_(false) {
 			nh_ = nh;
 			cmd_vel_pub_ = nh_.advertise<geometry_msgs::Twist>("cmd_vel_mux/input/navi", 10);//"/base_controller/command", 1);
+			ros::NodeHandle params("~");
+			params.param("control_rate", control_rate_, 20.0);
+			params.param("max_linear_accel", max_linear_accel_, 0.5);
+			params.param("max_angular_accel", max_angular_accel_, 2.0);
+			params.param("command_timeout", command_timeout_, 0.5);
+			if(control_rate_ <= 0)
+				control_rate_ = 20.0;
 		}
 
-		bool drive(const string & cmd) {
-			cout << "[accepted] " << cmd << endl;
+		// publishes once a period until stop(). nothing is published while
+		// the robot stands still with nowhere to go, so the mux can hand the
+		// base to a lower priority input
+		void run() {
+			typedef std::chrono::steady_clock clock;
+			auto period = std::chrono::duration_cast<clock::duration>(
+					std::chrono::duration<double>(1.0 / control_rate_));
+			geometry_msgs::Twist current, target;
+			bool moving = false;
+			auto last = clock::now();
+			auto next = last + period;
+			std::unique_lock<std::mutex> lock(mutex_);
+			while(!stopped_) {
+				if(!moving)
+					cond_.wait(lock, [this]() { return stopped_ || target_changed_; });
+				else
+					cond_.wait_until(lock, next, [this]() { return stopped_; });
+				if(stopped_)
+					break;
+				auto now = clock::now();
+				bool timed_out = !still(target_) && now >= deadline_;
+				if(timed_out) {
+					target_ = geometry_msgs::Twist();
+					++metrics_.timeouts;
+				}
+				deadline_metrics metrics = metrics_;
+				target = target_;
+				target_changed_ = false;
+				lock.unlock();
+
+				if(timed_out) {
+					cout << "[deadline] no fresh command, stopping" << endl;
+					metrics.dump(cout);
+				}
+				double dt = std::chrono::duration<double>(now - last).count();
+				if(!moving)
+					dt = 1.0 / control_rate_;
+				last = now;
+				// a late tick is not made up with a burst of publishes
+				next += period;
+				if(next <= now)
+					next = now + period;
+
+				current.linear.x = ramp(current.linear.x, target.linear.x,
+						max_linear_accel_ * dt);
+				current.angular.z = ramp(current.angular.z, target.angular.z,
+						max_angular_accel_ * dt);
+				cmd_vel_pub_.publish(current);
+				moving = !still(current) || !still(target);
+				lock.lock();
+			}
+			lock.unlock();
+			if(!still(current))
+				cmd_vel_pub_.publish(geometry_msgs::Twist());
+		}
+
+		void stop() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopped_ = true;
+			cond_.notify_one();
+		}
+
+		// whether a command may be acted on. one that arrives past its
+		// deadline is dropped, unless it is a stop
+		bool fresh(const kinect_command & cmd) {
+			if(!cmd.stamped())
+				return true;
+			std::unique_lock<std::mutex> lock(mutex_);
+			++metrics_.stamped;
+			auto age = clock_.observe(cmd.issued(), command_clock::clock::now());
+			if(age.count() <= cmd.ttl())
+				return true;
+			++metrics_.expired;
+			bool keep = cmd.op() == kinect_command::stop;
+			if(!keep)
+				++metrics_.dropped;
+			deadline_metrics metrics = metrics_;
+			lock.unlock();
+			cout << "[deadline] " << kinect_command::name(cmd.op()) << " arrived "
+				<< age.count() - cmd.ttl() << " ms late"
+				<< (keep ? "" : ", dropped") << endl;
+			metrics.dump(cout);
+			return keep;
+		}
+
+		// the newest command replaces the target, whether or not run() got
+		// to the one before
+		bool drive(const kinect_command & cmd) {
+			cout << "[accepted] " << kinect_command::name(cmd.op()) << endl;
 			geometry_msgs::Twist base_cmd;
-			if(cmd.substr(0, 7) == "forward") {
-				base_cmd.linear.x = 0.25;
-				cout << "forward" << endl;
-			} else if(cmd.substr(0, 4) == "left") {
-				base_cmd.linear.x = 0.25;
-				base_cmd.angular.z = 0.75;
-				cout << "turn left" << endl;
-			} else if(cmd.substr(0, 5) == "right") {
-				base_cmd.linear.x = 0.25;
-				base_cmd.angular.z = -0.75;
-				cout << "turn right" << endl;
-			} else if(cmd.substr(0, 4) == "stop") {
-				cout << "stop" << endl;
-			} else {
-				cout << "unknown command" << endl;
-				return false;
+			switch(cmd.op()) {
+				case kinect_command::forward:
+					base_cmd.linear.x = 0.25;
+					cout << "forward" << endl;
+					break;
+				case kinect_command::left:
+					base_cmd.linear.x = 0.25;
+					base_cmd.angular.z = 0.75;
+					cout << "turn left" << endl;
+					break;
+				case kinect_command::right:
+					base_cmd.linear.x = 0.25;
+					base_cmd.angular.z = -0.75;
+					cout << "turn right" << endl;
+					break;
+				case kinect_command::stop:
+					cout << "stop" << endl;
+					break;
+				default:
+					cout << "unknown command" << endl;
+					return false;
+			}
+			// an explicit twist from the sender overrides the defaults
+			if(cmd.twist()) {
+				base_cmd.linear.x = cmd.linear();
+				base_cmd.angular.z = cmd.angular();
 			}
-			cmd_vel_pub_.publish(base_cmd);
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto now = command_clock::clock::now();
+			if(cmd.stamped())
+				deadline_ = now + std::chrono::milliseconds(cmd.ttl())
+					- clock_.age(cmd.issued(), now);
+			else if(command_timeout_ > 0)
+				deadline_ = now + std::chrono::duration_cast<command_clock::clock::duration>(
+						std::chrono::duration<double>(command_timeout_));
+			else
+				deadline_ = command_clock::clock::time_point::max();
+			target_ = base_cmd;
+			target_changed_ = true;
+			cond_.notify_one();
 			return true;
 		}
 
@@ -78,146 +213,409 @@ class Robot {
 		}
 
 	private:
+		// moves value toward target by at most step
+		static double ramp(double value, double target, double step) {
+			if(target > value + step)
+				return value + step;
+			if(target < value - step)
+				return value - step;
+			return target;
+		}
+
+		static bool still(const geometry_msgs::Twist& twist) {
+			return twist.linear.x == 0 && twist.angular.z == 0;
+		}
+
 		ros::NodeHandle nh_;
 		ros::Publisher cmd_vel_pub_;
+		double control_rate_;
+		double max_linear_accel_;
+		double max_angular_accel_;
+		double command_timeout_;
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		geometry_msgs::Twist target_;
+		command_clock::clock::time_point deadline_;
+		command_clock clock_;
+		deadline_metrics metrics_;
+		bool target_changed_;
+		bool stopped_;
 
 };
 
 
+// handlers run on strand_, so any number of threads may run the io_service.
+// in shared-memory mode run() drives the connection on the calling thread
+// and the strand is not used
 class chat_client
 {
 	public:
+		// the client keeps reconnecting until close(), and policy says what
+		// it sends from the time it was disconnected
 		chat_client(asio::io_service& io_service,
 				tcp::resolver::iterator endpoint_iterator,
-				Robot & robot)
-			: io_service_(io_service),
+				Robot & robot, offline_policy policy = offline_latest)
+			: endpoints_(endpoint_iterator),
 			socket_(io_service),
+			strand_(io_service),
+			reconnect_timer_(io_service),
+			connected_(false),
+			closing_(false),
+			disconnected_at_(std::chrono::steady_clock::now()),
+			offline_(policy),
+			flush_pending_(false),
+			format_(chat_message::ascii_header),
+			sequence_(0),
+			shm_open_(false),
+			shm_index_(0),
+			shm_offset_(0),
 			robot_(robot),
 			start(0)
 	{
-		do_connect(endpoint_iterator);
+		outbox_.reserve(max_write_batch);
+		flushing_.reserve(max_write_batch);
+		write_msgs_.reserve(max_write_batch);
+		writing_msgs_.reserve(max_write_batch);
+		// a relay on this machine is reached through shared memory if it
+		// offers it, bypassing the network stack
+		if (!start_shm(*endpoint_iterator))
+			do_connect();
 	}
 
+		// in shared-memory mode, runs the connection on the calling thread
+		// until the relay goes away. otherwise returns at once and the
+		// io_service carries the connection
+		void run()
+		{
+			if (shm_)
+				run_shm();
+		}
+
+		// may be called from any thread, messages wait in outbox_ until one
+		// posted handler moves them all to the write queue
 		void write(const chat_message& msg)
 		{
-			io_service_.post(
-					[this, msg]()
-					{
-					bool write_in_progress = !write_msgs_.empty();
-					write_msgs_.push_back(msg);
-					if (!write_in_progress)
+			std::lock_guard<std::mutex> lock(outbox_mutex_);
+			outbox_.push_back(msg);
+			if (flush_pending_)
+				return;
+			flush_pending_ = true;
+			if (shm_)
+			{
+				shm_->to_peer().interrupt();
+				return;
+			}
+			strand_.post(make_custom_alloc_handler(flush_allocator_,
+					[this]()
 					{
-					do_write();
-					}
-					});
+					flush_outbox();
+					}));
+		}
+
+		// queued in binary form, prepare() falls back to the legacy text if
+		// the relay only speaks v1
+		void write(const kinect_command& cmd)
+		{
+			chat_message msg(chat_message::binary_header);
+			cmd.encode(msg);
+			write(msg);
 		}
 
 		void close()
 		{
-			io_service_.post([this]() { socket_.close(); });
+			strand_.post([this]()
+					{
+					closing_ = true;
+					reconnect_timer_.cancel();
+					socket_.close();
+					});
 		}
 
 	private:
-		void do_connect(tcp::resolver::iterator endpoint_iterator)
+		void do_connect()
 		{
-			asio::async_connect(socket_, endpoint_iterator,
+			asio::async_connect(socket_, endpoints_, strand_.wrap(
 					[this](std::error_code ec, tcp::resolver::iterator)
 					{
+					if (closing_)
+						return;
 					if (!ec)
+						connected();
+					else
+						reconnect();
+					}));
+		}
+
+		// a new connection starts in v1 until the relay answers the hello,
+		// which goes ahead of whatever was kept while disconnected
+		void connected()
+		{
+			connected_ = true;
+			format_ = chat_message::ascii_header;
+			read_buffer_.consume(read_buffer_.size());
+			if (backoff_.attempts() != 0)
+			{
+				auto outage = std::chrono::steady_clock::now() - disconnected_at_;
+				metrics_.record(
+						std::chrono::duration_cast<reconnect_metrics::duration>(outage));
+				metrics_.dump(std::cout);
+			}
+			backoff_.reset();
+			send_hello();
+			offline_.drain([this](chat_message& msg)
 					{
-					do_read_header();
-					}
+					write_msgs_.push_back(msg);
+					prepare(write_msgs_.back());
 					});
+			if (writing_msgs_.empty() && !write_msgs_.empty())
+				do_write();
+			do_read();
 		}
 
-		void do_read_header()
+		// a read or write failed. unsent messages are kept under the offline
+		// policy, the one being written is not sent again
+		void disconnected()
 		{
-			asio::async_read(socket_,
-					asio::buffer(read_msg_.data(), chat_message::header_length),
-					[this](std::error_code ec, std::size_t /*length*/)
-					{
-					if (!ec && read_msg_.decode_header())
-					{
-					do_read_body();
-					}
-					else
+			if (!connected_)
+				return;
+			connected_ = false;
+			disconnected_at_ = std::chrono::steady_clock::now();
+			asio::error_code ec;
+			socket_.close(ec);
+			for (auto& msg: write_msgs_)
+				offline_.push(msg);
+			write_msgs_.clear();
+			std::cout << "[reconnect] connection lost" << endl;
+			reconnect();
+		}
+
+		void reconnect()
+		{
+			if (closing_)
+				return;
+			reconnect_timer_.expires_from_now(backoff_.next());
+			reconnect_timer_.async_wait(strand_.wrap(
+					[this](const asio::error_code& ec)
 					{
-					socket_.close();
-					}
-					});
+					if (!ec && !closing_)
+						do_connect();
+					}));
 		}
 
-		void do_read_body()
+		static bool aborted(const std::error_code& ec)
 		{
-			asio::async_read(socket_,
-					asio::buffer(read_msg_.body(), read_msg_.body_length()),
-					[this](std::error_code ec, std::size_t /*length*/)
+			return ec == asio::error_code(asio::error::operation_aborted);
+		}
+
+		// announce protocol v2 with a v1 frame, binary headers are only used
+		// once the relay answers with a binary frame
+		void send_hello()
+		{
+			chat_message msg;
+			msg.make_hello();
+			bool write_in_progress = !writing_msgs_.empty();
+			write_msgs_.push_back(msg);
+			if (!write_in_progress)
+			{
+				do_write();
+			}
+		}
+
+		void send_subscribe()
+		{
+			chat_message msg(chat_message::binary_header);
+			msg.make_subscribe(chat_message::command_topic);
+			bool write_in_progress = !writing_msgs_.empty();
+			write_msgs_.push_back(msg);
+			if (!write_in_progress)
+			{
+				do_write();
+			}
+		}
+
+		// answers the relay's heartbeat, so that it keeps the session open
+		void send_heartbeat()
+		{
+			chat_message msg(chat_message::binary_header);
+			msg.make_heartbeat();
+			bool write_in_progress = !writing_msgs_.empty();
+			write_msgs_.push_back(msg);
+			if (!write_in_progress)
+			{
+				do_write();
+			}
+		}
+
+		void flush_outbox()
+		{
+			{
+				std::lock_guard<std::mutex> lock(outbox_mutex_);
+				outbox_.swap(flushing_);
+				flush_pending_ = false;
+			}
+			if (!connected_)
+			{
+				for (auto& msg: flushing_)
+					offline_.push(msg);
+				flushing_.clear();
+				return;
+			}
+			bool write_in_progress = !writing_msgs_.empty();
+			for (auto& msg: flushing_)
+			{
+				write_msgs_.push_back(msg);
+				prepare(write_msgs_.back());
+			}
+			flushing_.clear();
+			if (!write_in_progress)
+			{
+				do_write();
+			}
+		}
+
+		// brings a queued message into the connection's format
+		void prepare(chat_message& msg)
+		{
+			if (format_ != chat_message::binary_header)
+			{
+				kinect_command cmd;
+				if (msg.format() == chat_message::binary_header && cmd.decode(msg))
+				{
+					msg.format(format_);
+					cmd.encode(msg);
+					msg.encode_header();
+				}
+				return;
+			}
+			msg.format(format_);
+			msg.sequence(++sequence_);
+			msg.encode_header();
+		}
+
+		// reads whatever the socket has and handles every complete frame in it
+		void do_read()
+		{
+			socket_.async_read_some(
+					asio::buffer(read_buffer_.prepare(), read_buffer_.space()),
+					strand_.wrap(make_custom_alloc_handler(read_allocator_,
+					[this](std::error_code ec, std::size_t length)
 					{
-					if (!ec)
+					if (!ec && read_done(length))
 					{
-					if(strncmp(read_msg_.body(), "[kinect]", strlen("[kinect]")) == 0) {
-						string msg_s = read_msg_.body();
-						msg_s = msg_s.substr(strlen("[kinect] "));
-						// std::cout.write(read_msg_.body(), read_msg_.body_length());
-						// std::cout << "\n";
-						std::cout << "[real command] " << msg_s << endl;
-						if(msg_s.substr(0, 6) == "button") {
-							cout << "button pushed" << endl;
-							if(start == 0) { // initialize 
-								cout << "Init button pushed!" << endl;
-								start = 1;
-							} else if(start == 1) { // nothing done already
-								cout << "Just initialized! Won't do init again!" << endl;
-								// LOL
-							} else { // start == 2, something has done
-								cout << "Something has been done! Can rest now!" << endl;
-								start = 0;
-							}
-						}
-						else if(start != 0) {
-							cout << "command accepted" << endl;
-							start = 2; // something done!
-							robot_.drive(msg_s);
-						}
-						else { // start == 0
-							cout << "need button first!" << endl;
-						}
-						chat_message msg;
-						char msg_to_send_[chat_message::max_body_length] = "[kabuki] kinect message received";
-						/*msg.body_length(std::strlen(msg_to_send_));
-						std::memcpy(msg.body(), msg_to_send_, msg.body_length());
-						msg.encode_header();*/
-						// write(msg);
-					} else if(strncmp(read_msg_.body(), "[kabuki]", strlen("[kabuki]")) == 0) {
-						std::cout << "[success] kabuki message sent";
-						std::cout << "\n";
-					} else {
-						std::cout << "[error] message " << "\"";
-						// std::cout.write(read_msg_.body(), read_msg_.body_length());
-						std::cout << "\" not start with [kinect], discard";
-						std::cout << "\n";
-					}
-					do_read_header();
+						do_read();
+						return;
 					}
-					else
-					{
-						socket_.close();
+					if (!aborted(ec))
+						disconnected();
+					})));
+		}
+
+		// handles every complete frame after length more bytes have come in,
+		// returns false on a bad frame
+		bool read_done(std::size_t length)
+		{
+			read_buffer_.commit(length);
+			chat_header header;
+			chat_read_buffer::parse_result result;
+			while ((result = read_buffer_.parse_header(header,
+							chat_message::max_body_length))
+					== chat_read_buffer::frame_ready)
+			{
+				std::size_t frame = header.header_size() + header.body_length();
+				if (read_buffer_.size() < frame)
+					break;
+				read_msg_.assign(header, read_buffer_.data());
+				read_buffer_.consume(frame);
+				handle_message();
+			}
+			return result != chat_read_buffer::bad_frame;
+		}
+
+		void handle_message()
+		{
+			if (read_msg_.format() == chat_message::binary_header)
+				format_ = chat_message::binary_header;
+			kinect_command cmd;
+			if(read_msg_.is_heartbeat()) {
+				send_heartbeat();
+			} else if(read_msg_.is_hello()) {
+				// the relay speaks v2, only ask for commands from now on
+				if(read_msg_.format() == chat_message::binary_header)
+					send_subscribe();
+			} else if(!cmd.decode(read_msg_)) {
+				std::cout << "[error] message " << "\"";
+				// std::cout.write(read_msg_.body(), read_msg_.body_length());
+				std::cout << "\" not start with [kinect], discard";
+				std::cout << "\n";
+			} else if(cmd.op() != kinect_command::ack) {
+				// std::cout.write(read_msg_.body(), read_msg_.body_length());
+				// std::cout << "\n";
+				std::cout << "[real command] " << kinect_command::name(cmd.op()) << endl;
+				if(!robot_.fresh(cmd))
+					return;
+				if(cmd.op() == kinect_command::button) {
+					cout << "button pushed" << endl;
+					if(start == 0) { // initialize 
+						cout << "Init button pushed!" << endl;
+						start = 1;
+					} else if(start == 1) { // nothing done already
+						cout << "Just initialized! Won't do init again!" << endl;
+						// LOL
+					} else { // start == 2, something has done
+						cout << "Something has been done! Can rest now!" << endl;
+						start = 0;
 					}
-					});
+				}
+				else if(start != 0) {
+					cout << "command accepted" << endl;
+					start = 2; // something done!
+					robot_.drive(cmd);
+				}
+				else { // start == 0
+					cout << "need button first!" << endl;
+				}
+				// write(kinect_command(kinect_command::ack));
+			} else {
+				std::cout << "[success] kabuki message sent";
+				std::cout << "\n";
+			}
 		}
 
+		// sends everything queued so far, up to max_write_batch frames, with
+		// one gathered async_write. the batch moves to writing_msgs_ so that
+		// messages queued while it is in flight cannot move it
 		void do_write()
 		{
-			asio::async_write(socket_,
-					asio::buffer(write_msgs_.front().data(),
-						write_msgs_.front().length()),
+			if (write_msgs_.size() <= max_write_batch)
+			{
+				writing_msgs_.swap(write_msgs_);
+			}
+			else
+			{
+				writing_msgs_.assign(write_msgs_.begin(),
+						write_msgs_.begin() + max_write_batch);
+				write_msgs_.erase(write_msgs_.begin(),
+						write_msgs_.begin() + max_write_batch);
+			}
+			if (shm_)
+			{
+				shm_index_ = 0;
+				shm_offset_ = 0;
+				write_shm();
+				return;
+			}
+			write_buffers_.clear();
+			for (auto& msg: writing_msgs_)
+				write_buffers_.push_back(asio::buffer(msg.data(), msg.length()));
+			asio::async_write(socket_, const_buffers_ref(write_buffers_),
+					strand_.wrap(make_custom_alloc_handler(write_allocator_,
 					[this](std::error_code ec, std::size_t /*length*/)
 					{
 					//socket_.close();
 					// return ;
 					if (!ec)
 					{
-					write_msgs_.pop_front();
+					writing_msgs_.clear();
 					if (!write_msgs_.empty())
 					{
 					do_write();
@@ -225,19 +623,119 @@ class chat_client
 					}
 					else
 					{
-					socket_.close();
+					// after an abort the client may already be connected again
+					writing_msgs_.clear();
+					if (!aborted(ec))
+						disconnected();
+					else if (connected_ && !write_msgs_.empty())
+						do_write();
 					}
-					});
+					})));
+		}
+
+		// takes the relay's shared-memory channel if the relay is on this
+		// machine and offers one, the frames and the hello are as on tcp
+		bool start_shm(const tcp::endpoint& relay)
+		{
+			if (!relay.address().is_loopback())
+				return false;
+			shm_ = shm_channel::attach(shm_channel::name_for_port(relay.port()));
+			if (!shm_)
+				return false;
+			shm_open_ = true;
+			connected_ = true;
+			std::cout << "[shm] local relay, using shared memory" << endl;
+			send_hello();
+			return true;
+		}
+
+		// sleeps on the relay's ring between reads. write() interrupts the
+		// wait, and a write the ring had no room for is tried again shortly
+		void run_shm()
+		{
+			shm_ring& ring = shm_->to_peer();
+			while (shm_open_ && shm_->relay_alive())
+			{
+				std::uint32_t signal = ring.signal();
+				bool flush;
+				{
+					std::lock_guard<std::mutex> lock(outbox_mutex_);
+					flush = flush_pending_;
+				}
+				if (flush)
+					flush_outbox();
+				if (!writing_msgs_.empty())
+					write_shm();
+				char* p = read_buffer_.prepare();
+				std::size_t length = ring.read(p, read_buffer_.space());
+				if (length != 0)
+					shm_open_ = read_done(length);
+				else if (!flush)
+					ring.wait(signal,
+							writing_msgs_.empty() ? liveness_check_ms : shm_retry_ms);
+			}
+		}
+
+		// copies as much of the batch in writing_msgs_ as the relay's ring takes
+		void write_shm()
+		{
+			shm_ring& ring = shm_->to_relay();
+			while (shm_index_ < writing_msgs_.size())
+			{
+				chat_message& msg = writing_msgs_[shm_index_];
+				shm_offset_ += ring.write(msg.data() + shm_offset_,
+						msg.length() - shm_offset_);
+				if (shm_offset_ < msg.length())
+					break;
+				shm_offset_ = 0;
+				++shm_index_;
+			}
+			ring.notify();
+			if (shm_index_ == writing_msgs_.size())
+			{
+				writing_msgs_.clear();
+				if (!write_msgs_.empty())
+				{
+					do_write();
+				}
+			}
 		}
 
 	private:
-		asio::io_service& io_service_;
+		enum { max_write_batch = 64 };
+		enum { shm_retry_ms = 1, liveness_check_ms = 100 };
+
+		tcp::resolver::iterator endpoints_;
 		tcp::socket socket_;
+		asio::io_service::strand strand_;
+		asio::steady_timer reconnect_timer_;
+		reconnect_backoff backoff_;
+		reconnect_metrics metrics_;
+		bool connected_;
+		bool closing_;
+		std::chrono::steady_clock::time_point disconnected_at_;
+		offline_queue offline_;
+		chat_read_buffer read_buffer_;
 		chat_message read_msg_;
+		std::mutex outbox_mutex_;
+		chat_message_queue outbox_;
+		chat_message_queue flushing_;
+		bool flush_pending_;
 		chat_message_queue write_msgs_;
+		chat_message_queue writing_msgs_;
+		std::vector<asio::const_buffer> write_buffers_;
+		handler_allocator read_allocator_;
+		handler_allocator write_allocator_;
+		handler_allocator flush_allocator_;
+		chat_message::header_format format_;
+		std::uint32_t sequence_;
+		std::unique_ptr<shm_channel> shm_;
+		bool shm_open_;
+		std::size_t shm_index_;
+		std::size_t shm_offset_;
 	public:
 
-		Robot robot_;
+		Robot& robot_;
 		int start;
 };
 
@@ -263,8 +761,13 @@ int main(int argc, char ** argv) {
 		auto endpoint_iterator = resolver.resolve({ host, port });
 		chat_client c(io_service, endpoint_iterator, driver);
 
+		// the client's handlers run on its strand, so any number of threads
+		// may run the io_service. publishing has a thread of its own
+		std::thread publisher([&driver](){ driver.run(); });
 		std::thread t([&io_service](){ io_service.run(); });
 
+		c.run();
+
 		/*  char line[chat_message::max_body_length + 1];
 		  while (std::cin.getline(line, chat_message::max_body_length + 1))
 		  {
@@ -278,6 +781,8 @@ int main(int argc, char ** argv) {
 
 		c.close();
 		t.join();
+		driver.stop();
+		publisher.join();
 	}
 	catch (std::exception& e)
 	{
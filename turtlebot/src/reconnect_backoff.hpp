@@ -0,0 +1,190 @@
+//
+// reconnect_backoff.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// When an endpoint tries its relay again, and what it sends once it is back.
+//
+
+#ifndef RECONNECT_BACKOFF_HPP
+#define RECONNECT_BACKOFF_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <vector>
+#include "chat_message.hpp"
+#include "kinect_command.hpp"
+
+// Delays between connection attempts. The first retry after a drop comes
+// quickly, since most drops are a blip. After that the delay doubles up to
+// a cap, and half of each delay is random, so that robots which lost the
+// same access point do not all come back at once.
+class reconnect_backoff
+{
+public:
+  typedef std::chrono::milliseconds duration;
+
+  reconnect_backoff(duration first = duration(50),
+      duration base = duration(250), duration cap = duration(10000))
+    : first_(first),
+      base_(base),
+      cap_(cap),
+      attempts_(0),
+      random_(std::random_device()())
+  {
+  }
+
+  // The wait before the next attempt.
+  duration next()
+  {
+    if (attempts_++ == 0)
+      return first_;
+    duration::rep d = base_.count() << std::min(attempts_ - 2, 16u);
+    d = std::min(d, cap_.count());
+    std::uniform_int_distribution<duration::rep> jitter(0, d / 2);
+    return duration(d - d / 2 + jitter(random_));
+  }
+
+  // Called once connected.
+  void reset()
+  {
+    attempts_ = 0;
+  }
+
+  unsigned attempts() const
+  {
+    return attempts_;
+  }
+
+private:
+  duration first_;
+  duration base_;
+  duration cap_;
+  unsigned attempts_;
+  std::minstd_rand random_;
+};
+
+// What happens to messages written while disconnected, and to those still
+// queued when the connection dropped. A message that was being written at
+// the time may or may not have arrived and is not sent again, so a button
+// is never pressed twice.
+enum offline_policy
+{
+  offline_keep,   // send them all, oldest first
+  offline_latest, // send control commands and other messages, but only the
+                  // newest steering command, and none from before a stop
+  offline_drop    // send nothing from before the reconnect
+};
+
+// Holds messages for the next connection under an offline_policy, at most
+// limit of them. When full the oldest goes. Hellos, subscriptions and
+// heartbeats belong to the connection they were written for and are
+// always dropped.
+class offline_queue
+{
+public:
+  offline_queue(offline_policy policy = offline_latest,
+      std::size_t limit = 256)
+    : policy_(policy),
+      limit_(limit),
+      dropped_(0)
+  {
+  }
+
+  void push(const chat_message& msg)
+  {
+    if (msg.is_hello() || msg.is_heartbeat()
+        || (msg.format() == chat_message::binary_header
+          && msg.type() == chat_message::subscribe_type))
+      return;
+    if (policy_ == offline_drop)
+    {
+      ++dropped_;
+      return;
+    }
+    kinect_command cmd;
+    if (policy_ == offline_latest && cmd.decode(msg)
+        && (kinect_command::steering(cmd.op())
+          || cmd.op() == kinect_command::stop))
+      drop_steering();
+    if (limit_ != 0 && msgs_.size() >= limit_)
+    {
+      msgs_.erase(msgs_.begin());
+      ++dropped_;
+    }
+    msgs_.push_back(msg);
+  }
+
+  // Calls f(chat_message&) with each message held, oldest first, and
+  // empties the queue.
+  template <typename Function>
+  void drain(Function f)
+  {
+    for (auto& msg: msgs_)
+      f(msg);
+    msgs_.clear();
+  }
+
+  std::size_t dropped() const
+  {
+    return dropped_;
+  }
+
+private:
+  void drop_steering()
+  {
+    std::size_t kept = 0;
+    for (auto& msg: msgs_)
+    {
+      kinect_command cmd;
+      if (cmd.decode(msg) && kinect_command::steering(cmd.op()))
+        ++dropped_;
+      else
+        msgs_[kept++] = msg;
+    }
+    msgs_.resize(kept);
+  }
+
+  offline_policy policy_;
+  std::size_t limit_;
+  std::size_t dropped_;
+  std::vector<chat_message> msgs_;
+};
+
+// How long the endpoint has been without its relay.
+struct reconnect_metrics
+{
+  typedef std::chrono::milliseconds duration;
+
+  reconnect_metrics()
+    : reconnects(0),
+      last(0),
+      longest(0),
+      total(0)
+  {
+  }
+
+  void record(duration d)
+  {
+    ++reconnects;
+    last = d;
+    longest = std::max(longest, d);
+    total += d;
+  }
+
+  void dump(std::ostream& os) const
+  {
+    os << "[reconnect] back after " << last.count() << " ms, "
+      << reconnects << " reconnects, longest " << longest.count()
+      << " ms, total " << total.count() << " ms\n";
+  }
+
+  std::size_t reconnects;
+  duration last;
+  duration longest;
+  duration total;
+};
+
+#endif // RECONNECT_BACKOFF_HPP
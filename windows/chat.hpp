@@ -2,116 +2,427 @@
 #define CHAT_HPP
 
 #include "common.h"
+#include <array>
+#include <atomic>
 #include "message.hpp"
+#include "handler_allocator.hpp"
+#include "kinect_command.hpp"
+#include "reconnect_backoff.hpp"
+#include "spsc_queue.hpp"
 
 using namespace std;
 using asio::ip::tcp;
+using asio::ip::udp;
 
-typedef std::deque<chat_message> chat_message_queue;
+typedef std::vector<chat_message> chat_message_queue;
 
 class chat_client
 {
 public:
+	// with udp_steering, steering commands go as datagrams if the relay
+	// offers it. the client keeps reconnecting until close(), and policy
+	// says what it sends from the time it was disconnected. commands are
+	// stamped with the time they were written and expire command_ttl
+	// later, zero sends them unstamped
 	chat_client(asio::io_service& io_service,
-		tcp::resolver::iterator endpoint_iterator)
+		tcp::resolver::iterator endpoint_iterator, bool udp_steering = false,
+		offline_policy policy = offline_latest,
+		std::chrono::milliseconds command_ttl = std::chrono::milliseconds(500))
 		: io_service_(io_service),
-		socket_(io_service)
+		endpoints_(endpoint_iterator),
+		socket_(io_service),
+		reconnect_timer_(io_service),
+		connected_(false),
+		closing_(false),
+		disconnected_at_(std::chrono::steady_clock::now()),
+		offline_(policy),
+		flush_pending_(false),
+		dropped_(0),
+		reported_dropped_(0),
+		format_(chat_message::ascii_header),
+		sequence_(0),
+		udp_socket_(io_service),
+		udp_steering_(udp_steering),
+		command_ttl_(static_cast<std::uint16_t>(command_ttl.count() < 0xffff
+			? command_ttl.count() : 0xffff))
 	{
-		do_connect(endpoint_iterator);
+		write_msgs_.reserve(max_write_batch);
+		writing_msgs_.reserve(max_write_batch);
+		do_connect();
 	}
 
+	// called from one thread only, the sensor loop. messages go into the
+	// outbox_ ring, and the first one since the last flush posts a handler
+	// that moves them all to the write queue. neither blocks nor allocates:
+	// if the network thread falls outbox_capacity messages behind, the
+	// message is dropped and counted
 	void write(const chat_message& msg)
 	{
-		io_service_.post(
-			[this, msg]()
+		chat_message* slot = outbox_.prepare();
+		if (!slot)
 		{
-			bool write_in_progress = !write_msgs_.empty();
-			write_msgs_.push_back(msg);
-			if (!write_in_progress)
-			{
-				do_write();
-			}
-		});
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		*slot = msg;
+		outbox_.commit();
+		wake();
+	}
+
+	// encoded straight into the ring in binary form, prepare() falls back to
+	// the legacy text if the relay only speaks v1
+	void write(const kinect_command& cmd)
+	{
+		chat_message* slot = outbox_.prepare();
+		if (!slot)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		slot->format(chat_message::binary_header);
+		slot->flags(0);
+		if (command_ttl_ != 0 && !cmd.stamped())
+		{
+			kinect_command stamped(cmd);
+			stamped.stamp(now_ms(), command_ttl_);
+			stamped.encode(*slot);
+		}
+		else
+			cmd.encode(*slot);
+		outbox_.commit();
+		wake();
 	}
 
 	void close()
 	{
-		io_service_.post([this]() { socket_.close(); });
+		io_service_.post([this]()
+		{
+			closing_ = true;
+			reconnect_timer_.cancel();
+			socket_.close();
+		});
 	}
 
 private:
-	void do_connect(tcp::resolver::iterator endpoint_iterator)
+	// the issue time commands are stamped with
+	static std::uint32_t now_ms()
 	{
-		asio::async_connect(socket_, endpoint_iterator,
+		return static_cast<std::uint32_t>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void do_connect()
+	{
+		asio::async_connect(socket_, endpoints_,
 			[this](std::error_code ec, tcp::resolver::iterator)
 		{
+			if (closing_)
+				return;
 			if (!ec)
-			{
-				do_read_header();
-			}
+				connected();
+			else
+				reconnect();
 		});
 	}
 
-	void do_read_header()
+	// a new connection starts in v1 until the relay answers the hello,
+	// which goes ahead of whatever was kept while disconnected
+	void connected()
 	{
-		asio::async_read(socket_,
-			asio::buffer(read_msg_.data(), chat_message::header_length),
-			[this](std::error_code ec, std::size_t /*length*/)
+		connected_ = true;
+		format_ = chat_message::ascii_header;
+		read_buffer_.consume(read_buffer_.size());
+		if (backoff_.attempts() != 0)
+		{
+			auto outage = std::chrono::steady_clock::now() - disconnected_at_;
+			metrics_.record(
+				std::chrono::duration_cast<reconnect_metrics::duration>(outage));
+			metrics_.dump(std::cout);
+		}
+		backoff_.reset();
+		send_hello();
+		offline_.drain([this](chat_message& msg)
 		{
-			if (!ec && read_msg_.decode_header())
+			write_msgs_.push_back(msg);
+			prepare(write_msgs_.back());
+		});
+		if (writing_msgs_.empty() && !write_msgs_.empty())
+			do_write();
+		do_read();
+	}
+
+	// a read or write failed. unsent messages are kept under the offline
+	// policy, the one being written is not sent again
+	void disconnected()
+	{
+		if (!connected_)
+			return;
+		connected_ = false;
+		disconnected_at_ = std::chrono::steady_clock::now();
+		asio::error_code ec;
+		socket_.close(ec);
+		udp_socket_.close(ec);
+		for (auto& msg : write_msgs_)
+			offline_.push(msg);
+		write_msgs_.clear();
+		std::cout << "[reconnect] connection lost\n";
+		reconnect();
+	}
+
+	void reconnect()
+	{
+		if (closing_)
+			return;
+		reconnect_timer_.expires_from_now(backoff_.next());
+		reconnect_timer_.async_wait([this](const asio::error_code& ec)
+		{
+			if (!ec && !closing_)
+				do_connect();
+		});
+	}
+
+	static bool aborted(const std::error_code& ec)
+	{
+		return ec == asio::error_code(asio::error::operation_aborted);
+	}
+
+	// announce protocol v2 with a v1 frame, binary headers are only used
+	// once the relay answers with a binary frame
+	void send_hello()
+	{
+		chat_message msg;
+		msg.make_hello();
+		bool write_in_progress = !writing_msgs_.empty();
+		write_msgs_.push_back(msg);
+		if (!write_in_progress)
+		{
+			do_write();
+		}
+	}
+
+	void send_subscribe()
+	{
+		chat_message msg(chat_message::binary_header);
+		msg.make_subscribe(chat_message::ack_topic);
+		bool write_in_progress = !writing_msgs_.empty();
+		write_msgs_.push_back(msg);
+		if (!write_in_progress)
+		{
+			do_write();
+		}
+	}
+
+	// answers the relay's heartbeat, so that it keeps the session open
+	void send_heartbeat()
+	{
+		chat_message msg(chat_message::binary_header);
+		msg.make_heartbeat();
+		bool write_in_progress = !writing_msgs_.empty();
+		write_msgs_.push_back(msg);
+		if (!write_in_progress)
+		{
+			do_write();
+		}
+	}
+
+	// the producer's half of the handoff. only a write that finds no flush
+	// pending posts one, so a burst of commands costs one wakeup
+	void wake()
+	{
+		if (flush_pending_.exchange(true))
+			return;
+		io_service_.post(make_custom_alloc_handler(flush_allocator_,
+			[this]()
+		{
+			flush_outbox();
+		}));
+	}
+
+	// clears flush_pending_ before draining, so that a message committed
+	// after the drain has looked at the ring posts a flush of its own
+	void flush_outbox()
+	{
+		flush_pending_.store(false);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::size_t dropped = dropped_.load(std::memory_order_relaxed);
+		if (dropped != reported_dropped_)
+		{
+			std::cout << "[error] outbox full, " << dropped - reported_dropped_
+				<< " messages dropped\n";
+			reported_dropped_ = dropped;
+		}
+		if (!connected_)
+		{
+			outbox_.consume([this](chat_message& msg)
 			{
-				do_read_body();
-			}
-			else
+				offline_.push(msg);
+			});
+			return;
+		}
+		bool write_in_progress = !writing_msgs_.empty();
+		outbox_.consume([this](chat_message& msg)
+		{
+			if (send_datagram(msg))
+				return;
+			write_msgs_.push_back(msg);
+			prepare(write_msgs_.back());
+		});
+		if (!write_in_progress && !write_msgs_.empty())
+		{
+			do_write();
+		}
+	}
+
+	// brings a queued message into the connection's format
+	void prepare(chat_message& msg)
+	{
+		if (format_ != chat_message::binary_header)
+		{
+			kinect_command cmd;
+			if (msg.format() == chat_message::binary_header && cmd.decode(msg))
 			{
-				socket_.close();
+				msg.format(format_);
+				cmd.encode(msg);
+				msg.encode_header();
 			}
-		});
+			return;
+		}
+		msg.format(format_);
+		msg.sequence(++sequence_);
+		msg.encode_header();
 	}
 
-	void do_read_body()
+	// the relay's hello offered udp_steering, datagrams go to the same
+	// address and port as the stream
+	void open_steering_channel(std::uint32_t token)
 	{
-		asio::async_read(socket_,
-			asio::buffer(read_msg_.body(), read_msg_.body_length()),
-			[this](std::error_code ec, std::size_t /*length*/)
+		asio::error_code ec;
+		tcp::endpoint relay = socket_.remote_endpoint(ec);
+		if (ec || token == 0)
+			return;
+		relay_udp_ = udp::endpoint(relay.address(), relay.port());
+		udp_socket_.open(relay_udp_.protocol(), ec);
+		if (ec)
+			return;
+		chat_store_le32(token_, token);
+		std::cout << "[udp] steering over datagrams\n";
+	}
+
+	// sends a steering command as a datagram instead of queueing it, if the
+	// channel is open. datagrams share sequence_ with the stream, so the
+	// relay drops one that arrives after a newer stop
+	bool send_datagram(chat_message& msg)
+	{
+		kinect_command cmd;
+		if (!udp_socket_.is_open() || msg.format() != chat_message::binary_header
+			|| !cmd.decode(msg) || !kinect_command::steering(cmd.op()))
+			return false;
+		msg.sequence(++sequence_);
+		msg.encode_header();
+		std::array<asio::const_buffer, 2> buffers = { {
+			asio::buffer(token_), asio::buffer(msg.data(), msg.length()) } };
+		asio::error_code ec;
+		udp_socket_.send_to(buffers, relay_udp_, 0, ec);
+		return true;
+	}
+
+	// reads whatever the socket has and handles every complete frame in it
+	void do_read()
+	{
+		socket_.async_read_some(
+			asio::buffer(read_buffer_.prepare(), read_buffer_.space()),
+			make_custom_alloc_handler(read_allocator_,
+			[this](std::error_code ec, std::size_t length)
 		{
 			if (!ec)
 			{
-				if (strncmp(read_msg_.body(), "[kabuki]", strlen("[kabuki]")) == 0) {
-					std::cout << "[success] kabuki message received";
-					std::cout << "\n";
-				}
-				else if (strncmp(read_msg_.body(), "[kinect]", strlen("[kinect]")) == 0) {
-					std::cout << "[success] kinect message sent";
-					std::cout << "\n";
+				read_buffer_.commit(length);
+				chat_header header;
+				chat_read_buffer::parse_result result;
+				while ((result = read_buffer_.parse_header(header,
+					chat_message::max_body_length))
+					== chat_read_buffer::frame_ready)
+				{
+					std::size_t frame = header.header_size() + header.body_length();
+					if (read_buffer_.size() < frame)
+						break;
+					read_msg_.assign(header, read_buffer_.data());
+					read_buffer_.consume(frame);
+					handle_message();
 				}
-				else {
-					std::cout << "[error] message " << "\"";
-					std::cout.write(read_msg_.body(), read_msg_.body_length());
-					std::cout << "\" not start with [kabuki], discard";
-					std::cout << "\n";
+				if (result != chat_read_buffer::bad_frame)
+				{
+					do_read();
+					return;
 				}
-
-				do_read_header();
 			}
-			else
+			else if (aborted(ec))
 			{
-				socket_.close();
+				return;
 			}
-		});
+			disconnected();
+		}));
+	}
+
+	void handle_message()
+	{
+		if (read_msg_.format() == chat_message::binary_header)
+			format_ = chat_message::binary_header;
+		kinect_command cmd;
+		if (read_msg_.is_heartbeat()) {
+			send_heartbeat();
+		}
+		else if (read_msg_.is_hello()) {
+			// the relay speaks v2, only ask for robot acks from now on
+			if (read_msg_.format() == chat_message::binary_header)
+				send_subscribe();
+			if (udp_steering_ && (read_msg_.flags() & chat_header::udp_steering))
+				open_steering_channel(read_msg_.hello_token(read_msg_.body()));
+		}
+		else if (!cmd.decode(read_msg_)) {
+			std::cout << "[error] message " << "\"";
+			std::cout.write(read_msg_.body(), read_msg_.body_length());
+			std::cout << "\" not start with [kabuki], discard";
+			std::cout << "\n";
+		}
+		else if (cmd.op() == kinect_command::ack) {
+			std::cout << "[success] kabuki message received";
+			std::cout << "\n";
+		}
+		else {
+			std::cout << "[success] kinect message sent";
+			std::cout << "\n";
+		}
 	}
 
+	// sends everything queued so far, up to max_write_batch frames, with
+	// one gathered async_write. the batch moves to writing_msgs_ so that
+	// messages queued while it is in flight cannot move it
 	void do_write()
 	{
-		asio::async_write(socket_,
-			asio::buffer(write_msgs_.front().data(),
-			write_msgs_.front().length()),
+		if (write_msgs_.size() <= max_write_batch)
+		{
+			writing_msgs_.swap(write_msgs_);
+		}
+		else
+		{
+			writing_msgs_.assign(write_msgs_.begin(),
+				write_msgs_.begin() + max_write_batch);
+			write_msgs_.erase(write_msgs_.begin(),
+				write_msgs_.begin() + max_write_batch);
+		}
+		write_buffers_.clear();
+		for (auto& msg : writing_msgs_)
+			write_buffers_.push_back(asio::buffer(msg.data(), msg.length()));
+		asio::async_write(socket_, const_buffers_ref(write_buffers_),
+			make_custom_alloc_handler(write_allocator_,
 			[this](std::error_code ec, std::size_t /*length*/)
 		{
 			// cout << "to_send" << endl;
 			if (!ec)
 			{
-				write_msgs_.pop_front();
+				writing_msgs_.clear();
 				if (!write_msgs_.empty())
 				{
 					// cout << "sent" << endl;
@@ -120,16 +431,49 @@ private:
 			}
 			else
 			{
-				socket_.close();
+				// after an abort the client may already be connected again
+				writing_msgs_.clear();
+				if (!aborted(ec))
+					disconnected();
+				else if (connected_ && !write_msgs_.empty())
+					do_write();
 			}
-		});
+		}));
 	}
 
 private:
+	enum { max_write_batch = 64 };
+	enum { outbox_capacity = 128 };
+
 	asio::io_service& io_service_;
+	tcp::resolver::iterator endpoints_;
 	tcp::socket socket_;
+	asio::steady_timer reconnect_timer_;
+	reconnect_backoff backoff_;
+	reconnect_metrics metrics_;
+	bool connected_;
+	bool closing_;
+	std::chrono::steady_clock::time_point disconnected_at_;
+	offline_queue offline_;
+	chat_read_buffer read_buffer_;
 	chat_message read_msg_;
+	spsc_queue<chat_message, outbox_capacity> outbox_;
+	std::atomic<bool> flush_pending_;
+	std::atomic<std::size_t> dropped_;
+	std::size_t reported_dropped_;
 	chat_message_queue write_msgs_;
+	chat_message_queue writing_msgs_;
+	std::vector<asio::const_buffer> write_buffers_;
+	handler_allocator read_allocator_;
+	handler_allocator write_allocator_;
+	handler_allocator flush_allocator_;
+	chat_message::header_format format_;
+	std::uint32_t sequence_;
+	udp::socket udp_socket_;
+	udp::endpoint relay_udp_;
+	char token_[chat_header::datagram_token_length];
+	bool udp_steering_;
+	std::uint16_t command_ttl_;
 };
 
 #endif
@@ -762,15 +762,9 @@ int kinectSensor(chat_client & _c) {
 							&& bDetected) {
 							head_detected = true;
 							std::cout << "[INFO] hand over head Gesture detected" << std::endl;
-							chat_message msg;
-							string head_msg = "[kinect] button";
-							msg.body_length(head_msg.size());
-							std::memcpy(msg.body(), head_msg.c_str(), msg.body_length());
-							msg.body()[msg.body_length()] = 0;
 							// cout << head_msg << endl;
-							cout << msg.body() << endl;
-							msg.encode_header();
-							_c.write(msg);
+							cout << "[kinect] " << kinect_command::name(kinect_command::button) << endl;
+							_c.write(kinect_command(kinect_command::button));
 						}
 					}
 					SafeRelease(discrete_result);
@@ -809,28 +803,19 @@ int kinectSensor(chat_client & _c) {
 										// nothing
 									}
 									std::wcout << L"[INFO] " << gesture_name << L'\n';
-									chat_message msg;
 									// wstring w_msg = gesture_name;
 									// std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 									// std::string s_msg = converter.to_bytes(w_msg);
-									std::string s_msg = wConvToS(gesture_name);
-									string multi_msg = "[kinect] ";
-									if (s_msg == "Steer_Left") {
-										multi_msg += "left";
+									kinect_command::opcode op = kinect_command::forward;
+									if (wcscmp(gesture_name, L"Steer_Left") == 0) {
+										op = kinect_command::left;
 									}
-									else if (s_msg == "Steer_Right") {
-										multi_msg += "right";
+									else if (wcscmp(gesture_name, L"Steer_Right") == 0) {
+										op = kinect_command::right;
 									}
-									else {
-										multi_msg += "forward";
-									}
-									msg.body_length(multi_msg.size());
-									std::memcpy(msg.body(), multi_msg.c_str(), msg.body_length());
-									msg.body()[msg.body_length()] = 0;
-									msg.encode_header();
 									// cout << multi_msg << endl;
-									cout << msg.body() << endl;
-									_c.write(msg);
+									cout << "[kinect] " << kinect_command::name(op) << endl;
+									_c.write(kinect_command(op));
 								} // get_Detected
 							} // get_DiscreteGestureResult
 							SafeRelease(discrete_result);
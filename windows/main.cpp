@@ -21,7 +21,8 @@ int main(int argc, char* argv[])
 		const char * host = "10.0.0.10", *port = "8888";
 		// auto endpoint_iterator = resolver.resolve({ argv[1], argv[2] });
 		auto endpoint_iterator = resolver.resolve({ host, port });
-		chat_client c(io_service, endpoint_iterator);
+		// steering goes over udp when the relay offers it
+		chat_client c(io_service, endpoint_iterator, true);
 
 		std::thread t([&io_service](){ io_service.run(); });
 
@@ -14,15 +14,306 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <vector>
 
-class chat_message
+// Two header formats share the wire. Protocol v1 frames carry the body
+// length as four ASCII digits ("%4d"). Protocol v2 frames start with
+// binary_magic, which can never appear in a v1 header, followed by:
+//
+//   offset 0  uint8   magic
+//   offset 1  uint8   version
+//   offset 2  uint8   type
+//   offset 3  uint8   flags
+//   offset 4  uint32  body length, little-endian
+//   offset 8  uint32  sequence, little-endian
+//
+// A v2 peer announces itself with a v1 hello frame (see hello_prefix) and
+// only switches to binary headers once the other end answers with a binary
+// frame, so a v1 peer never sees a header it cannot parse.
+//
+// A relay whose binary hello has the udp_steering flag also takes steering
+// commands as UDP datagrams on the same port. Each datagram is the token
+// from that hello, little-endian, followed by one binary frame.
+//
+// A relay sends an empty heartbeat_type frame to a v2 peer it has not heard
+// from for a while, and the peer answers with one of its own. A v2 peer
+// that stays silent through several heartbeats is disconnected.
+
+inline std::uint32_t chat_load_le32(const char* p)
+{
+	std::uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+inline void chat_store_le32(char* p, std::uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	std::memcpy(p, &v, sizeof(v));
+}
+
+// Header fields and their encoding, shared by every message representation.
+class chat_header
 {
 public:
 	enum { header_length = 4 };
-	enum { max_body_length = 512 };
+	enum { binary_header_length = 12 };
+	enum { max_header_length = binary_header_length };
+	enum { legacy_max_body_length = 512 };
+
+	enum { binary_magic = 0xc5 };
+	enum { protocol_version = 2 };
+
+	enum header_format { ascii_header, binary_header };
+
+	enum message_type
+	{
+		data_type = 0,
+		hello_type = 1,
+		command_type = 2,
+		subscribe_type = 3,
+		heartbeat_type = 4
+	};
+
+	// Flags of a relay's binary hello.
+	enum hello_flag
+	{
+		udp_steering = 0x01
+	};
+
+	enum { datagram_token_length = 4 };
+
+	// Routing classes. A v2 peer picks the ones it wants with a
+	// subscribe_type frame whose body is the little-endian topic mask; peers
+	// that never subscribe get all of them.
+	enum topic
+	{
+		data_topic = 0x01,
+		command_topic = 0x02,
+		ack_topic = 0x04,
+		all_topics = data_topic | command_topic | ack_topic
+	};
+
+	// A hello body is hello_prefix() optionally followed by a space and the
+	// largest body the sender accepts. Without it the peer takes 512 bytes.
+	// A relay offering udp_steering adds another space and the token.
+	static const char* hello_prefix()
+	{
+		return "[hello] 2";
+	}
+
+	explicit chat_header(header_format format = ascii_header)
+		: format_(format),
+		type_(data_type),
+		flags_(0),
+		sequence_(0),
+		body_length_(0)
+	{
+	}
+
+	std::size_t body_length() const
+	{
+		return body_length_;
+	}
+
+	header_format format() const
+	{
+		return format_;
+	}
+
+	std::size_t header_size() const
+	{
+		return format_ == binary_header
+			? static_cast<std::size_t>(binary_header_length)
+			: static_cast<std::size_t>(header_length);
+	}
+
+	// Bytes still to be read after the first header_length bytes before the
+	// body can be read. Only non-zero for binary headers.
+	std::size_t header_remaining() const
+	{
+		return header_size() - header_length;
+	}
+
+	message_type type() const
+	{
+		return static_cast<message_type>(type_);
+	}
+
+	void type(message_type t)
+	{
+		type_ = static_cast<std::uint8_t>(t);
+	}
+
+	std::uint8_t flags() const
+	{
+		return flags_;
+	}
+
+	void flags(std::uint8_t f)
+	{
+		flags_ = f;
+	}
+
+	std::uint32_t sequence() const
+	{
+		return sequence_;
+	}
+
+	void sequence(std::uint32_t s)
+	{
+		sequence_ = s;
+	}
+
+	// Decodes the first header_length bytes at p. If they start a binary
+	// header, header_remaining() more bytes must follow at p + header_length
+	// and be passed to decode_binary_header() before the body.
+	bool decode_header(const char* p, std::size_t max_body)
+	{
+		if (static_cast<unsigned char>(p[0]) == binary_magic)
+		{
+			format_ = binary_header;
+			body_length_ = 0;
+			return true;
+		}
+
+		format_ = ascii_header;
+		type_ = data_type;
+		flags_ = 0;
+		sequence_ = 0;
+		char header[header_length + 1] = "";
+		strncat_s(header, p, header_length);
+		body_length_ = std::atoi(header);
+		if (body_length_ > max_body)
+		{
+			body_length_ = 0;
+			return false;
+		}
+		return true;
+	}
+
+	bool decode_binary_header(const char* p, std::size_t max_body)
+	{
+		if (static_cast<unsigned char>(p[1]) < protocol_version)
+			return false;
+		type_ = static_cast<std::uint8_t>(p[2]);
+		flags_ = static_cast<std::uint8_t>(p[3]);
+		std::uint32_t length = chat_load_le32(p + 4);
+		sequence_ = chat_load_le32(p + 8);
+		if (length > max_body)
+		{
+			body_length_ = 0;
+			return false;
+		}
+		body_length_ = length;
+		return true;
+	}
+
+	void encode_header(char* p) const
+	{
+		if (format_ == binary_header)
+		{
+			p[0] = static_cast<char>(binary_magic);
+			p[1] = static_cast<char>(protocol_version);
+			p[2] = static_cast<char>(type_);
+			p[3] = static_cast<char>(flags_);
+			chat_store_le32(p + 4, static_cast<std::uint32_t>(body_length_));
+			chat_store_le32(p + 8, sequence_);
+			return;
+		}
+
+		char header[header_length + 1] = "";
+		sprintf_s(header, "%4d", static_cast<int>(body_length_));
+		std::memcpy(p, header, header_length);
+	}
+
+	// True for a hello in either format: a binary hello_type frame, or a v1
+	// frame whose body starts with hello_prefix().
+	bool is_hello(const char* body) const
+	{
+		if (format_ == binary_header)
+			return type_ == hello_type;
+		std::size_t n = std::strlen(hello_prefix());
+		return body_length_ >= n && std::memcmp(body, hello_prefix(), n) == 0;
+	}
+
+	bool is_heartbeat() const
+	{
+		return format_ == binary_header && type_ == heartbeat_type;
+	}
+
+	// The largest body the sender of a hello accepts.
+	std::size_t hello_max_body(const char* body) const
+	{
+		std::size_t max_body = hello_field(body, 0);
+		return max_body ? max_body
+			: static_cast<std::size_t>(legacy_max_body_length);
+	}
+
+	// The datagram token in a relay's hello, or 0 if it has none.
+	std::uint32_t hello_token(const char* body) const
+	{
+		return static_cast<std::uint32_t>(hello_field(body, 1));
+	}
+
+	// The topic mask carried by a subscribe_type frame.
+	std::uint32_t subscribed_topics(const char* body) const
+	{
+		return body_length_ >= 4 ? chat_load_le32(body) : 0;
+	}
+
+	// Writes a hello advertising max_body, and token unless it is 0,
+	// returning its length.
+	static std::size_t encode_hello(char* body, std::size_t max_body,
+			std::uint32_t token = 0)
+	{
+		if (token != 0)
+			return sprintf_s(body, legacy_max_body_length + 1, "%s %u %u", hello_prefix(),
+					static_cast<unsigned>(max_body), static_cast<unsigned>(token));
+		return sprintf_s(body, legacy_max_body_length + 1, "%s %u", hello_prefix(),
+				static_cast<unsigned>(max_body));
+	}
+
+protected:
+	// The number in the index-th space-separated field after hello_prefix(),
+	// or 0.
+	std::size_t hello_field(const char* body, int index) const
+	{
+		std::size_t i = std::strlen(hello_prefix());
+		for (;;)
+		{
+			if (i >= body_length_ || body[i] != ' ')
+				return 0;
+			std::size_t value = 0;
+			for (++i; i < body_length_ && body[i] >= '0' && body[i] <= '9'; ++i)
+				value = value * 10 + (body[i] - '0');
+			if (index-- == 0)
+				return value;
+		}
+	}
+
+	header_format format_;
+	std::uint8_t type_;
+	std::uint8_t flags_;
+	std::uint32_t sequence_;
+	std::size_t body_length_;
+};
+
+// Fixed-size message used by the endpoints. Bodies above max_body_length
+// need pooled_message.
+class chat_message : public chat_header
+{
+public:
+	enum { max_body_length = legacy_max_body_length };
 
-	chat_message()
-		: body_length_(0)
+	explicit chat_message(header_format format = ascii_header)
+		: chat_header(format)
 	{
 	}
 
@@ -38,17 +329,17 @@ public:
 
 	std::size_t length() const
 	{
-		return header_length + body_length_;
+		return header_size() + body_length_;
 	}
 
 	const char* body() const
 	{
-		return data_ + header_length;
+		return data_ + header_size();
 	}
 
 	char* body()
 	{
-		return data_ + header_length;
+		return data_ + header_size();
 	}
 
 	std::size_t body_length() const
@@ -63,29 +354,167 @@ public:
 			body_length_ = max_body_length;
 	}
 
+	header_format format() const
+	{
+		return format_;
+	}
+
+	// Switches the header format, moving the body so that it stays directly
+	// behind the header. The header must be encoded again afterwards.
+	void format(header_format new_format)
+	{
+		if (new_format == format_)
+			return;
+		char* old_body = body();
+		format_ = new_format;
+		std::memmove(body(), old_body, body_length_);
+	}
+
+	bool is_hello() const
+	{
+		return chat_header::is_hello(body());
+	}
+
+	// Turns this into a hello advertising max_body_length.
+	void make_hello()
+	{
+		type(hello_type);
+		body_length(encode_hello(body(), max_body_length));
+		encode_header();
+	}
+
+	// Turns this into a subscription to topics. Only valid in binary format.
+	void make_subscribe(std::uint32_t topics)
+	{
+		type(subscribe_type);
+		body_length(4);
+		chat_store_le32(body(), topics);
+		encode_header();
+	}
+
+	std::uint32_t subscribed_topics() const
+	{
+		return chat_header::subscribed_topics(body());
+	}
+
+	// Turns this into a heartbeat. Only valid in binary format.
+	void make_heartbeat()
+	{
+		type(heartbeat_type);
+		body_length(0);
+		encode_header();
+	}
+
+	// Takes a complete frame whose header was already decoded into h.
+	void assign(const chat_header& h, const char* frame)
+	{
+		static_cast<chat_header&>(*this) = h;
+		std::memcpy(data_, frame, length());
+	}
+
 	bool decode_header()
 	{
-		char header[header_length + 1] = "";
-		strncat_s(header, data_, header_length);
-		body_length_ = std::atoi(header);
-		if (body_length_ > max_body_length)
+		return chat_header::decode_header(data_, max_body_length);
+	}
+
+	bool decode_binary_header()
+	{
+		return chat_header::decode_binary_header(data_, max_body_length);
+	}
+
+	void encode_header()
+	{
+		chat_header::encode_header(data_);
+	}
+
+private:
+	// Room for a binary header plus the body, and a terminating NUL some
+	// callers write after the body.
+	char data_[max_header_length + max_body_length + 1];
+};
+
+// Receive buffer for reading as much as the socket has in one go and then
+// taking every complete frame out of it. A partial frame stays in the buffer
+// and is moved to the front before the next read.
+class chat_read_buffer
+{
+public:
+	enum parse_result { frame_ready, need_more, bad_frame };
+
+	explicit chat_read_buffer(std::size_t capacity = 4096)
+		: buffer_(capacity),
+		begin_(0),
+		end_(0)
+	{
+	}
+
+	std::size_t capacity() const
+	{
+		return buffer_.size();
+	}
+
+	// Where the next read should go.
+	char* prepare()
+	{
+		if (begin_ > 0)
 		{
-			body_length_ = 0;
-			return false;
+			std::memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+			end_ -= begin_;
+			begin_ = 0;
 		}
-		return true;
+		return &buffer_[end_];
 	}
 
-	void encode_header()
+	// Room for the next read once prepare() has moved the unconsumed bytes
+	// to the front, so a call may take both in either order.
+	std::size_t space() const
 	{
-		char header[header_length + 1] = "";
-		sprintf_s(header, "%4d", static_cast<int>(body_length_));
-		std::memcpy(data_, header, header_length);
+		return buffer_.size() - size();
+	}
+
+	void commit(std::size_t n)
+	{
+		end_ += n;
+	}
+
+	// Unconsumed bytes, starting at the next frame.
+	const char* data() const
+	{
+		return &buffer_[begin_];
+	}
+
+	std::size_t size() const
+	{
+		return end_ - begin_;
+	}
+
+	void consume(std::size_t n)
+	{
+		begin_ += n;
+		if (begin_ == end_)
+			begin_ = end_ = 0;
+	}
+
+	// Decodes the header at data() into h. frame_ready means the header is
+	// complete; the whole frame is in the buffer once size() reaches
+	// h.header_size() + h.body_length().
+	parse_result parse_header(chat_header& h, std::size_t max_body) const
+	{
+		if (size() < chat_header::header_length)
+			return need_more;
+		if (!h.decode_header(data(), max_body))
+			return bad_frame;
+		if (h.header_remaining() == 0)
+			return frame_ready;
+		if (size() < chat_header::binary_header_length)
+			return need_more;
+		return h.decode_binary_header(data(), max_body) ? frame_ready : bad_frame;
 	}
 
 private:
-	char data_[header_length + max_body_length];
-	std::size_t body_length_;
+	std::vector<char> buffer_;
+	std::size_t begin_;
+	std::size_t end_;
 };
 
 #endif // CHAT_MESSAGE_HPP
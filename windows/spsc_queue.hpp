@@ -0,0 +1,83 @@
+//
+// spsc_queue.hpp
+// ~~~~~~~~~~~~~~
+//
+// Hands messages from one producer thread to one consumer thread.
+//
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A bounded single-producer, single-consumer ring of Capacity slots, a power
+// of two. The producer fills a slot in place with prepare() and commit(),
+// so nothing is allocated or copied twice, and a full ring is reported
+// rather than waited on. Neither side takes a lock. Each side keeps a copy
+// of the other's position and only reloads it when the copy says the ring
+// is full, or empty, so the two cache lines are rarely passed back and forth.
+template <typename T, std::size_t Capacity>
+class spsc_queue
+{
+public:
+	static_assert((Capacity & (Capacity - 1)) == 0,
+		"spsc_queue capacity must be a power of two");
+
+	spsc_queue()
+		: head_(0),
+		tail_(0),
+		cached_head_(0),
+		cached_tail_(0)
+	{
+	}
+
+	// producer. the slot to fill next, or null if the ring is full
+	T* prepare()
+	{
+		std::size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - cached_head_ == Capacity)
+		{
+			cached_head_ = head_.load(std::memory_order_acquire);
+			if (tail - cached_head_ == Capacity)
+				return 0;
+		}
+		return &slots_[tail & (Capacity - 1)];
+	}
+
+	// producer. publishes the slot prepare() returned
+	void commit()
+	{
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release);
+	}
+
+	// consumer. calls f(T&) with everything committed so far, oldest first,
+	// then frees the slots, and returns how many there were
+	template <typename Function>
+	std::size_t consume(Function f)
+	{
+		std::size_t head = head_.load(std::memory_order_relaxed);
+		if (head == cached_tail_)
+		{
+			cached_tail_ = tail_.load(std::memory_order_acquire);
+			if (head == cached_tail_)
+				return 0;
+		}
+		std::size_t n = cached_tail_ - head;
+		for (std::size_t i = 0; i < n; ++i)
+			f(slots_[(head + i) & (Capacity - 1)]);
+		head_.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+private:
+	alignas(64) std::atomic<std::size_t> head_;
+	alignas(64) std::atomic<std::size_t> tail_;
+	alignas(64) std::size_t cached_head_; // producer's
+	alignas(64) std::size_t cached_tail_; // consumer's
+	T slots_[Capacity];
+};
+
+#endif // SPSC_QUEUE_HPP